@@ -0,0 +1,64 @@
+/* channel_bench.c: cost of tolayer3() as the channel fills up.
+
+   Preloads the A->B channel with n packets in flight, then keeps the
+   occupancy at n by delivering the oldest packet after every new send,
+   the way a sender with an n packet window would. The time per send
+   should stay flat as n grows.
+
+   build and run:
+     gcc -O2 -o channel_bench bench/channel_bench.c -lpthread && ./channel_bench
+*/
+
+#define main gbn_main   /* keep the simulator's own main out of the way */
+#include "../prog2_gbn.c"
+#undef main
+
+#include <time.h>
+
+#define SEND_STEPS 200000
+
+double bench_send(struct sim *sim, int n, struct pkt *packet)
+{
+   struct event *evptr;
+   clock_t start;
+   int i;
+
+   for (i=0; i<n; i++)
+      tolayer3(sim, A, packet);
+
+   start = clock();
+   for (i=0; i<SEND_STEPS; i++) {
+      tolayer3(sim, A, packet);
+      evptr = popevent(sim);      /* oldest packet reaches B */
+      sim->now = evptr->evtime;
+      freepkt(sim, evptr->pktptr);
+      freeevent(sim, evptr);
+      }
+   start = clock() - start;
+
+   while ((evptr = popevent(sim)) != NULL) {
+      sim->now = evptr->evtime;
+      freepkt(sim, evptr->pktptr);
+      freeevent(sim, evptr);
+      }
+   return(1e9 * start / CLOCKS_PER_SEC / SEND_STEPS);
+}
+
+int main()
+{
+   struct sim *sim;
+   struct pkt *packet;
+   int n;
+
+   params.trace = 0;
+   params.lossprob = 0.0;
+   params.corruptprob = 0.0;
+   sim = newsim(&params);
+   freeevent(sim, popevent(sim));  /* only our packets in the queue */
+   packet = make_pkt(sim, 1, 0, "aaaaaaaaaaaaaaaaaaaa", MSGSIZE, MSGSIZE);
+   for (n=1; n<=100000; n*=10)
+      printf("packets in flight %6d: %8.1f ns per send\n", n, bench_send(sim, n, packet));
+   freepkt(sim, packet);
+   freesim(sim);
+   return(0);
+}
@@ -0,0 +1,197 @@
+/* checksum_bench.c: speed of the packet checksums, and how much of each
+   kind of corruption they catch.
+
+   the first table times pktchecksum() on a data packet for each -k
+   choice, plus the two CRC32C kernels on their own. the second sends
+   packets with random headers and payloads through some corruption
+   models and counts the corrupted packets each checksum lets through:
+   the emulator's own (tolayer3() with corruption probability 1), one and
+   two flipped bits, two payload bytes swapped and two 16 bit words of
+   the payload swapped.
+
+   build and run:
+     gcc -O2 -o checksum_bench bench/checksum_bench.c -lpthread && ./checksum_bench
+*/
+
+#define main gbn_main   /* keep the simulator's own main out of the way */
+#include "../prog2_gbn.c"
+#undef main
+
+#include <time.h>
+
+#define SPEED_STEPS   10000000
+#define DETECT_PKTS   1000000
+#define PAYLOAD_LEN   MSGSIZE  /* bytes in each packet's payload */
+
+#define M_EMULATOR    0
+#define M_BITFLIP     1
+#define M_BITFLIP2    2
+#define M_BYTESWAP    3
+#define M_WORDSWAP    4
+#define NMODELS       5
+char *modelnames[NMODELS] = {"emulator", "1 bit", "2 bits", "byte swap", "word swap"};
+
+volatile int sink;             /* keeps the timed loops from being dropped */
+
+double bench_speed(struct sim *sim, struct pkt *packet)
+{
+   clock_t start;
+   int i, sum = 0;
+
+   start = clock();
+   for (i=0; i<SPEED_STEPS; i++) {
+      packet->seqnum = i;
+      sum += pktchecksum(sim, packet);
+      }
+   start = clock() - start;
+   sink = sum;
+   return(1e9 * start / CLOCKS_PER_SEC / SPEED_STEPS);
+}
+
+double bench_crc(uint32_t (*kernel)(uint32_t, unsigned char *, int), unsigned char *buf, int n)
+{
+   clock_t start;
+   uint32_t crc = 0;
+   int i;
+
+   start = clock();
+   for (i=0; i<SPEED_STEPS; i++)
+      crc += kernel(i, buf, n);
+   start = clock() - start;
+   sink = crc;
+   return(1e9 * start / CLOCKS_PER_SEC / SPEED_STEPS);
+}
+
+/* flip bit k of the packet's seqnum, acknum and payload, taken in order */
+void flipbit(struct pkt *p, int k)
+{
+   if (k<32)
+      p->seqnum ^= 1u<<k;
+   else if (k<64)
+      p->acknum ^= 1u<<(k-32);
+   else
+      p->payload[(k-64)/8] ^= 1<<((k-64)%8);
+}
+
+int randint(struct sim *sim, int n)
+{
+   return((int)(n*jimsrand(sim, RAND_CORRUPT)) % n);
+}
+
+/* corrupt a copy of packet with model m, its payload copied into data */
+struct pkt corrupt(struct sim *sim, struct pkt *packet, int m, char *data)
+{
+   struct event *evptr;
+   struct pkt p = *packet;
+   int i, j;
+   char c;
+
+   p.payload = data;
+   memcpy(data, packet->payload, packet->len);
+   switch (m) {
+   case M_EMULATOR:
+      tolayer3(sim, A, packet);
+      evptr = popevent(sim);
+      p = *evptr->pktptr;
+      p.payload = data;
+      memcpy(data, evptr->pktptr->payload, p.len);
+      freepkt(sim, evptr->pktptr);
+      freeevent(sim, evptr);
+      break;
+   case M_BITFLIP:
+      flipbit(&p, randint(sim, 64+8*PAYLOAD_LEN));
+      break;
+   case M_BITFLIP2:
+      i = randint(sim, 64+8*PAYLOAD_LEN);
+      while ((j = randint(sim, 64+8*PAYLOAD_LEN))==i)
+         ;
+      flipbit(&p, i);
+      flipbit(&p, j);
+      break;
+   case M_BYTESWAP:
+      i = randint(sim, PAYLOAD_LEN);
+      j = randint(sim, PAYLOAD_LEN);
+      c = p.payload[i];
+      p.payload[i] = p.payload[j];
+      p.payload[j] = c;
+      break;
+   case M_WORDSWAP:
+      i = 2*randint(sim, PAYLOAD_LEN/2);
+      j = 2*randint(sim, PAYLOAD_LEN/2);
+      c = p.payload[i]; p.payload[i] = p.payload[j]; p.payload[j] = c;
+      c = p.payload[i+1]; p.payload[i+1] = p.payload[j+1]; p.payload[j+1] = c;
+      break;
+      }
+   return(p);
+}
+
+int main()
+{
+   struct sim *sim;
+   struct pkt *packet, bad;
+   char payload[PAYLOAD_LEN], baddata[PAYLOAD_LEN];
+   unsigned char buf[CKHDRBYTES+PAYLOAD_LEN];
+   long ncorrupted[NMODELS], nmissed[NCKSUMS][NMODELS];
+   int i, k, m;
+
+   params.trace = 0;
+   params.lossprob = 0.0;
+   params.corruptprob = 1.0;
+   sim = newsim(&params);
+   freeevent(sim, popevent(sim));  /* only our packets in the queue */
+
+   for (i=0; i<PAYLOAD_LEN; i++)
+      payload[i] = 'a' + i;
+   packet = make_pkt(sim, 1, 0, payload, PAYLOAD_LEN, PAYLOAD_LEN);
+   pkthdrbytes(buf, packet);
+   memcpy(buf+CKHDRBYTES, payload, PAYLOAD_LEN);
+   pthread_once(&crc32conce, crc32cinit);
+   printf("checksum of a %d byte data packet:\n", PAYLOAD_LEN);
+   for (k=0; k<NCKSUMS; k++) {
+      sim->cksum = k;
+      printf("  %-16s %6.1f ns\n", cksumnames[k], bench_speed(sim, packet));
+      }
+   printf("  %-16s %6.1f ns\n", "crc32c table", bench_crc(crc32csw, buf, sizeof(buf)));
+   if (crc32chwok)
+      printf("  %-16s %6.1f ns\n", "crc32c hardware", bench_crc(crc32chw, buf, sizeof(buf)));
+    else
+      printf("  crc32c hardware  (not on this cpu)\n");
+
+   memset(ncorrupted, 0, sizeof(ncorrupted));
+   memset(nmissed, 0, sizeof(nmissed));
+   for (i=0; i<DETECT_PKTS; i++) {
+      for (k=0; k<PAYLOAD_LEN; k++)
+         payload[k] = randint(sim, 256);
+      for (m=0; m<NMODELS; m++) {
+         sim->cksum = CK_SUM;   /* one checksum to fill in, the others below */
+         fill_pkt(sim, packet, randint(sim, 1<<16), randint(sim, 1<<16),
+                  payload, PAYLOAD_LEN, PAYLOAD_LEN);
+         bad = corrupt(sim, packet, m, baddata);
+         if (bad.seqnum==packet->seqnum && bad.acknum==packet->acknum &&
+             bad.checksum==packet->checksum &&
+             memcmp(baddata, payload, PAYLOAD_LEN)==0)
+            continue;           /* e.g. 'Z' written over a 'Z' */
+         ncorrupted[m]++;
+         for (k=0; k<NCKSUMS; k++) {
+            sim->cksum = k;
+            fill_pkt(sim, packet, packet->seqnum, packet->acknum,
+                     payload, PAYLOAD_LEN, PAYLOAD_LEN);
+            bad.checksum = packet->checksum;
+            nmissed[k][m] += !pkt_is_corrupt(sim, &bad);
+            }
+         }
+      }
+   printf("\ncorrupted packets missed, out of %d per model:\n%-10s", DETECT_PKTS, "");
+   for (m=0; m<NMODELS; m++)
+      printf(" %12s", modelnames[m]);
+   printf("\n");
+   for (k=0; k<NCKSUMS; k++) {
+      printf("%-10s", cksumnames[k]);
+      for (m=0; m<NMODELS; m++)
+         printf(" %11.4f%%", 100.0*nmissed[k][m]/ncorrupted[m]);
+      printf("\n");
+      }
+   freepkt(sim, packet);
+   freesim(sim);
+   return(0);
+}
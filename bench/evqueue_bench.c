@@ -0,0 +1,64 @@
+/* evqueue_bench.c: compares the emulator's event schedulers.
+
+   Runs the classic "hold" workload against insertevent()/popevent():
+   the queue is filled with n pending events, then each step pops the
+   next one and schedules a replacement a random distance in the future,
+   so the queue size stays at n the whole time.
+
+   build and run once per scheduler:
+     gcc -O2 -o evq_heap bench/evqueue_bench.c -lpthread
+     gcc -O2 -DSCHEDULER=LIST_SCHEDULER -o evq_list bench/evqueue_bench.c -lpthread
+     ./evq_heap && ./evq_list
+*/
+
+#define main gbn_main   /* keep the simulator's own main out of the way */
+#include "../prog2_gbn.c"
+#undef main
+
+#include <time.h>
+
+#define HOLD_STEPS 20000
+
+double bench_hold(struct sim *sim, int n)
+{
+   struct event *evptr;
+   clock_t start;
+   int i;
+
+   for (i=0; i<n; i++) {
+      evptr = allocevent(sim);
+      evptr->evtime = sim->now + TICKS(1000*jimsrand(sim, RAND_DELAY));
+      evptr->evtype = FROM_LAYER5;  /* timers would go to the timer wheel */
+      evptr->eventity = A;
+      insertevent(sim, evptr);
+      }
+
+   start = clock();
+   for (i=0; i<HOLD_STEPS; i++) {
+      evptr = popevent(sim);
+      sim->now = evptr->evtime;
+      evptr->evtime = sim->now + TICKS(1000*jimsrand(sim, RAND_DELAY));
+      insertevent(sim, evptr);
+      }
+   start = clock() - start;
+
+   while ((evptr = popevent(sim)) != NULL)
+      freeevent(sim, evptr);
+   return(1e9 * start / CLOCKS_PER_SEC / HOLD_STEPS);
+}
+
+int main()
+{
+   struct sim *sim;
+   int n;
+
+   params.trace = 0;
+   sim = newsim(&params);
+   freeevent(sim, popevent(sim));  /* only our events in the queue */
+   printf("scheduler: %s\n",
+          SCHEDULER == LIST_SCHEDULER ? "sorted list" : "binary heap");
+   for (n=10; n<=10000; n*=10)
+      printf("pending events %6d: %10.1f ns per pop+insert\n", n, bench_hold(sim, n));
+   freesim(sim);
+   return(0);
+}
@@ -0,0 +1,124 @@
+/* timer_bench.c: cost of the start/cancel churn a sliding window sender
+   puts on its timers.
+
+   n timers are kept running with the retransmission timeout of the
+   sender, alongside a queue of packet arrivals. every arrival cancels one
+   timer and starts it again, the way GBN restarts its timer on each new
+   ACK, so the timers hardly ever go off. compare the timer wheel with
+   timers queued alongside the packets:
+     gcc -O2 -o timer_wheel bench/timer_bench.c -lpthread
+     gcc -O2 -DTIMERWHEEL=0 -o timer_queue bench/timer_bench.c -lpthread
+     ./timer_wheel && ./timer_queue
+
+   before timing anything it checks that a timer can't be cancelled
+   from its own interrupt routine: timers 0 to 3 are set, the first to go
+   off is cancelled the way a handler would (after timerfired()), and the
+   other three must still be pending and go off in order.
+*/
+
+#define main gbn_main   /* keep the simulator's own main out of the way */
+#include "../prog2_gbn.c"
+#undef main
+
+#include <time.h>
+
+#define CHURN_STEPS  200000
+#define CHURN_PKTS   100        /* packet arrivals pending at any time */
+#define CHURN_RTO    200.0
+
+double bench_churn(struct sim *sim, int n)
+{
+   struct timerh *timers;
+   struct event *evptr;
+   clock_t start;
+   int i, steps;
+
+   timers = (struct timerh *)malloc(n*sizeof(struct timerh));
+   for (i=0; i<n; i++)
+      timers[i] = settimer(sim, A, CHURN_RTO*jimsrand(sim, RAND_DELAY), i);
+   for (i=0; i<CHURN_PKTS; i++) {
+      evptr = allocevent(sim);
+      evptr->evtime = sim->now + TICKS(10*jimsrand(sim, RAND_DELAY));
+      evptr->evtype = FROM_LAYER3;
+      evptr->eventity = A;
+      insertevent(sim, evptr);
+      }
+
+   start = clock();
+   for (steps=0; steps<CHURN_STEPS; steps++) {
+      evptr = popevent(sim);
+      sim->now = evptr->evtime;
+      if (evptr->evtype==TIMER_INTERRUPT) {   /* went off after all */
+         i = evptr->timerid;
+         freeevent(sim, evptr);
+         }
+       else {
+         i = (int)(n*jimsrand(sim, RAND_DELAY)) % n;
+         canceltimer(sim, &timers[i]);
+         evptr->evtime = sim->now + TICKS(10*jimsrand(sim, RAND_DELAY));
+         insertevent(sim, evptr);
+         }
+      timers[i] = settimer(sim, A, CHURN_RTO, i);
+      }
+   start = clock() - start;
+
+   while ((evptr = popevent(sim)) != NULL)
+      freeevent(sim, evptr);
+   free(timers);
+   return(1e9 * start / CLOCKS_PER_SEC / CHURN_STEPS);
+}
+
+/* 0 if cancelling a timer from its own handler leaves the others alone */
+int check_selfcancel(struct sim *sim)
+{
+   struct timerh timers[4];
+   struct event *evptr;
+   int i, ok = 1;
+
+   for (i=0; i<4; i++)
+      timers[i] = settimer(sim, A, 10.0*(i+1), i);
+   evptr = popevent(sim);
+   sim->now = evptr->evtime;
+   timerfired(sim, evptr);
+   if (evptr->timerid!=0 || timerpending(&timers[0]) || canceltimer(sim, &timers[0]))
+      ok = 0;
+   freeevent(sim, evptr);
+   for (i=1; i<4; i++) {
+      if (!timerpending(&timers[i]))
+         ok = 0;
+      evptr = popevent(sim);
+      if (evptr==NULL) {
+         ok = 0;
+         break;
+         }
+      sim->now = evptr->evtime;
+      if (evptr->timerid!=i)
+         ok = 0;
+      freeevent(sim, evptr);
+      }
+   while ((evptr = popevent(sim)) != NULL) {
+      ok = 0;
+      freeevent(sim, evptr);
+      }
+   return(ok ? 0 : 1);
+}
+
+int main()
+{
+   struct sim *sim;
+   int n;
+
+   params.trace = 0;
+   sim = newsim(&params);
+   freeevent(sim, popevent(sim));  /* only our events in the queue */
+   printf("timers: %s\n", TIMERWHEEL ? "timing wheel" : "event queue");
+   if (check_selfcancel(sim)) {
+      printf("cancelling a timer from its own handler broke the others\n");
+      freesim(sim);
+      return(1);
+      }
+   for (n=1; n<=10000; n*=10)
+      printf("running timers %6d: %10.1f ns per cancel+start\n", n, bench_churn(sim, n));
+   freesim(sim);
+   return(0);
+}
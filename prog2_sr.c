@@ -0,0 +1,3738 @@
+#define _POSIX_C_SOURCE 200809L   /* strdup() and sysconf() under -std=c99 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>         /* SSE4.2 crc32 instructions for CRC32C */
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* ******************************************************************
+ ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
+
+   This code should be used for PA2, unidirectional or bidirectional
+   data transfer protocols (from A to B. Bidirectional transfer of data
+   is for extra credit and is not required).  Network properties:
+   - one way network delay averages five time units (longer if there
+     are other messages in the channel for GBN), but can be larger
+   - packets can be corrupted (either the header or the data portion)
+     or lost, according to user-defined probabilities
+   - packets will be delivered in the order in which they were sent
+     (although some can be lost).
+
+ MODIFICATIONS by jsevilla274
+   - include stdlib
+   - comment out malloc redefinitions in emulator code
+   - slightly alter function signatures in emulator code
+   - move certain definitions and declarations to resolve compiler errors
+**********************************************************************/
+
+#define BIDIRECTIONAL 0    /* default for -F: 1 for B to send messages */
+                           /* to A as well, through B_output */
+
+/* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
+/* 4 (students' code).  It contains the data (characters) to be delivered */
+/* to layer 5 via the students transport level protocol entities. the    */
+/* data comes from allocmsg() and is the protocol's from A_output() on:  */
+/* it hands it back with freemsg() once it no longer needs it, or with  */
+/* dropmsg() if it turns the message away.                              */
+struct msg {
+  int len;                 /* bytes of data, sim->msgsize */
+  char *data;
+  };
+
+/* a packet is the data unit passed from layer 4 (students code) to layer */
+/* 3 (teachers code).  Note the pre-defined packet structure, which all   */
+/* students must follow. packets come from allocpkt() with room for an    */
+/* MSS of payload, and are passed around by reference rather than copied: */
+/* the sender's window, the channel and the receiver can all hold the     */
+/* same packet, holdpkt() taking a reference and freepkt() dropping one.  */
+/* a packet must not be changed once it has been handed to tolayer3().    */
+struct pkt {
+   int seqnum;
+   int acknum;
+   int checksum;
+   int len;                /* bytes of payload, 0 for none */
+   int msglen;             /* bytes in the message the payload is part of */
+   char *payload;
+   int refs;               /* references to the packet, see holdpkt() */
+    };
+
+/* included these definition and declarations to resolve compiler errors */
+
+/* simulated time is counted in ticks, TICKS_PER_UNIT of them to the time */
+/* unit, in 64 bits. adding up ticks is exact, so events can't round into */
+/* one another however long a run goes, and comes out the same on every   */
+/* platform. TICKS() turns a (non-negative) time in time units into ticks */
+/* and TICKTIME() turns ticks back; the protocols see sim->time in units. */
+#define  TICKS_PER_UNIT  (1<<20)
+#define  TICKS(t)        ((int64_t)((t)*(double)TICKS_PER_UNIT + 0.5))
+#define  TICKTIME(k)     ((double)(k)/TICKS_PER_UNIT)
+
+struct event {
+   int64_t evtime;         /* event time, in ticks */
+   int evtype;             /* event type code */
+   int eventity;           /* entity where event occurs */
+   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
+   struct event *prev;
+   struct event *next;
+   unsigned long evseq;    /* insertion order, used to break evtime ties */
+   int heapidx;            /* slot in the event heap (heap scheduler only) */
+   int wheelslot;          /* bucket of the timer wheel it's in (timers only) */
+   int timerid;            /* id the protocol gave a timer */
+ };
+
+/* a timer started with settimer(). it stays safe to cancel after the timer
+   went off or was cancelled, from its own interrupt routine too: the event
+   it points to has moved on to a new evseq (or none) by then, and
+   canceltimer() just returns 0 */
+struct timerh {
+   struct event *ev;
+   unsigned long evseq;
+};
+
+/* each simulation draws its random numbers from independent streams, one */
+/* per purpose, so e.g. changing the loss probability doesn't shift the   */
+/* delays every later packet sees. a stream is the philox4x32-10 counter  */
+/* based generator keyed on (seed, stream), see jimsrand().               */
+#define  RAND_ARRIVAL    0         /* message arrivals from layer 5 */
+#define  RAND_LOSS       1         /* packet losses */
+#define  RAND_CORRUPT    2         /* packet corruptions */
+#define  RAND_DELAY      3         /* channel delays */
+#define  RAND_QUEUE      4         /* RED's early drops */
+#define  RAND_MSGLEN     5         /* message lengths, with msgmin set */
+#define  NRANDSTREAMS    6
+
+struct randstream {
+   uint64_t ctr;              /* next block of the stream to generate */
+   uint32_t out[4];           /* current block */
+   int left;                  /* numbers of out[] not handed out yet */
+};
+
+struct pool {
+   size_t objsize;            /* bytes per object */
+   void *freelist;            /* objects ready to be handed out */
+   void *slabs;               /* every slab malloc'd, linked through slab[0] */
+   long nslabs;               /* slabs malloc'd so far */
+   long nalloc, nfree;        /* objects handed out and returned */
+   long inuse, maxinuse;      /* objects currently out, and the most ever */
+};
+
+/* timers are kept apart from the other events, in a hierarchical timing
+   wheel: WHEEL_LEVELS levels of WHEEL_SLOTS buckets, level L's buckets each
+   WHEEL_SLOTS^L wheel ticks of WHEEL_TICK clock ticks wide. a timer goes
+   into the bucket for its tick on the lowest level whose higher digits
+   match the wheel's, so starting or cancelling one is a list push or
+   unlink. */
+#define  WHEEL_BITS      6
+#define  WHEEL_SLOTS     (1<<WHEEL_BITS)
+#define  WHEEL_LEVELS    4
+#define  WHEEL_DUE       0                               /* bucket of timers due this tick */
+#define  WHEEL_OVERFLOW  (WHEEL_LEVELS*WHEEL_SLOTS+1)    /* bucket of timers beyond the wheel */
+#define  WHEEL_NBUCKETS  (WHEEL_LEVELS*WHEEL_SLOTS+2)
+#ifndef WHEEL_TICK
+#define  WHEEL_TICK      TICKS_PER_UNIT  /* one time unit */
+#endif
+
+struct wheel {
+   struct event *bucket[WHEEL_NBUCKETS]; /* linked through prev/next, the */
+                                         /* due bucket sorted like the queue */
+   uint64_t used[WHEEL_LEVELS];          /* bit s set if slot s is non-empty */
+   unsigned long now;                    /* tick the wheel has turned to */
+};
+
+/* checksums pktchecksum() can compute. CK_SUM is the original byte sum */
+#define  CK_SUM          0         /* seqnum + acknum + the payload bytes */
+#define  CK_INET         1         /* Internet checksum (RFC 1071) */
+#define  CK_CRC32C       2         /* CRC32C (Castagnoli) */
+#define  NCKSUMS         3
+
+/* the channel in each direction. with no bandwidth it is the original one:
+   a packet takes 1 to 10 time units, at random, to get across. with a
+   bandwidth it is a link: packets wait their turn in a FIFO queue, take
+   their size over the bandwidth to send, then propdelay to get across. a
+   queue that holds qlimit bytes drops the packets that don't fit
+   (drop-tail), or with RED starts dropping early as it fills up */
+#define  QD_DROPTAIL     0
+#define  QD_RED          1         /* random early detection, Floyd and Jacobson */
+#define  NQDISCS         2
+#define  LINKHDRBYTES   20         /* seqnum, acknum, checksum, len and msglen */
+#define  RED_WQ      0.002         /* weight of a sample in RED's average */
+#define  RED_MAXP      0.1         /* RED's drop probability at the upper threshold */
+
+struct link {
+   float bandwidth;           /* bytes per time unit, 0.0 for the original */
+                              /* channel */
+   float propdelay;           /* time to get across once sent */
+   int qlimit;                /* bytes the queue holds, 0 for no limit */
+   int64_t busyuntil;         /* when the link has sent all it has queued */
+   int64_t busytime;          /* ticks spent sending, for the utilisation */
+   float redavg;              /* RED's average queue length, bytes */
+   int redcount;              /* packets queued since RED last dropped one */
+};
+
+/* a sender's retransmission timeout and the round trips it is estimated
+   from. A and B each have one, since in duplex runs each sends data over
+   its own direction of the channel */
+struct rtoest {
+   float rto;                 /* timeout the protocol should use now */
+   float srtt, rttvar;        /* smoothed RTT and its mean deviation */
+   float minrtt;              /* least RTT measured, 0.0 before the first */
+};
+
+/* message latencies are kept in an HDR histogram: values below HDR_SUB
+   ticks get a bucket each, and above that every power of two is split
+   into HDR_SUB/2 buckets. a value is recorded to within 1/64 of itself
+   however large it is, in a fixed array and with a shift and an add */
+#define  HDR_SUBBITS     7
+#define  HDR_SUB         (1<<HDR_SUBBITS)
+#define  HDR_HALF        (HDR_SUB/2)
+#define  HDR_NBUCKETS    ((64-HDR_SUBBITS+1)*HDR_HALF)
+
+struct hdrhist {
+   long counts[HDR_NBUCKETS];
+   long n;                    /* values recorded */
+   int64_t min, max;
+   double sum;                /* of the values, for the mean */
+};
+
+/* messages A_output() or B_output() can't send yet can wait in the
+   entity's send queue, up to sendqlen of them. when it is full the
+   protocol drops the message (SQ_DROP), or layer 5 waits for room
+   (SQ_BLOCK): the message that finds the queue full is held, and no more
+   arrive until the protocol takes one off the queue */
+#define  SQ_DROP         0
+#define  SQ_BLOCK        1
+#define  NSQPOLICIES     2
+
+struct sendq {
+   struct msg *q;             /* ring of sendqlen messages */
+   int head, n;
+   struct msg held;           /* message layer 5 waits to queue, data NULL if none */
+   int64_t heldsince;
+   int64_t lastchange;        /* when n last changed */
+   double depthtime;          /* n integrated over ticks, for the mean */
+   int maxdepth;
+   int64_t blocktime;         /* ticks layer 5 spent waiting */
+};
+
+/* when the messages layer 5 handed one side were generated, oldest first.
+   the protocols deliver in order, so the oldest is the next one the other
+   side's layer 5 gets */
+struct stampq {
+   int64_t *t;
+   int size;                  /* slots allocated, a power of two */
+   int head, n;
+};
+
+/* one run of the emulator. everything a simulation changes lives in here
+   instead of in globals, so any number of them can run side by side in
+   threads. the protocol keeps each entity's state behind Astate and Bstate
+   (malloc'd by A_init() and B_init(), freed with the simulation) and leaves
+   the rest to the emulator. */
+struct sim {
+   void *Astate;              /* A's state, the protocol's own */
+   void *Bstate;              /* B's */
+   float timeoutlen;          /* retransmission timeout given on the command */
+                              /* line, 0.0 if the protocol should pick one */
+   int winsize;               /* send window given on the command line, 0 */
+                              /* if the protocol should pick one */
+   int aimd;                  /* grow and shrink the window with ACKs and */
+                              /* timeouts (AIMD), winsize being the most */
+   float window;              /* window the protocol is using right now */
+   int adaptive;              /* estimate the timeout from measured RTTs */
+   int cksum;                 /* checksum pktchecksum() computes, CK_* */
+   int msgsize;               /* bytes in each message from layer 5, or */
+                              /* the most with msgmin set */
+   int msgmin;                /* with this set, message lengths are drawn */
+                              /* from msgmin..msgsize instead */
+   int mss;                   /* most payload bytes a packet may carry */
+   struct link link[2];       /* the channel out of A, out of B */
+   int qdisc;                 /* how full link queues drop packets, QD_* */
+   int duplex;                /* messages arrive at B too */
+   float ackdelay;            /* longest a receiver may hold back an ACK, */
+                              /* hoping to piggyback it on data */
+   int dupthresh;             /* duplicate ACKs that make the sender resend */
+                              /* at once, 0 to wait for the timeout */
+   int sendqlen;              /* messages a send queue holds, 0 for none */
+   int sqpolicy;              /* what a full send queue does, SQ_* */
+   struct sendq sendq[2];     /* of A and B */
+   struct rtoest rtt[2];      /* A's and B's RTT estimates and timeouts */
+
+   int trace;                 /* TRACE level */
+   int nsimmax;               /* number of msgs to generate, then stop */
+   float lossprob;            /* probability that a packet is dropped  */
+   float corruptprob;         /* probability that one bit is packet is flipped */
+   float lambda;              /* arrival rate of messages from layer 5 */
+   unsigned int seed;         /* random number generator seed */
+
+   int64_t now;               /* the clock, in ticks */
+   double time;               /* the same in time units, for the protocols */
+   int nsim;                  /* number of messages from 5 to 4 so far */
+   int ntolayer3;             /* number sent into layer 3 */
+   int nlost;                 /* number lost in media */
+   int ncorrupt;              /* number corrupted by media*/
+   int nqdrop;                /* number dropped by a link's queue */
+   int ndelivered;            /* number delivered to layer 5 */
+   int nmsgdrop;              /* number the protocol turned away */
+   int nmsglost;              /* number taken but never delivered whole */
+   int nretransmit;           /* packets the protocol sent again */
+   int nspurious;             /* retransmissions that turned out unneeded */
+   int nackpkts;              /* packets with no payload, just an ACK */
+   int npiggyback;            /* ACKs that went out on data packets instead */
+   int nfastretx;             /* resends on duplicate ACKs */
+   int ntimeoutsaved;         /* of those, the ones ACKed before the timer */
+                              /* would have gone off */
+   struct stampq sent[2];     /* undelivered messages from layer 5 at A, B */
+   struct hdrhist latency;    /* generation to delivery, in ticks */
+   double windowtime;         /* window integrated over time, for its mean */
+
+   struct event *evlist;      /* the event list (list scheduler) */
+   struct event **evheap;     /* the event heap (heap scheduler) */
+   int evheapsize;            /* number of events in the heap */
+   int evheapcap;             /* allocated slots in the heap */
+   unsigned long nevinserted; /* events inserted so far, stamps evseq */
+   struct wheel wheel;        /* pending timer events */
+   struct event *timerev[2];  /* pending timer event of A and B */
+   int64_t lastarrival[2];    /* latest packet arrival scheduled at A, B */
+   struct pool eventpool;
+   struct pool pktpool;
+   struct pool msgpool;       /* message buffers, msgsize bytes each */
+   struct randstream rand[NRANDSTREAMS];
+   struct tracebuf *tracebuf; /* where trace output goes, NULL for nowhere */
+   struct evlog *evlog;       /* event log being written and/or replayed */
+   int replay;                /* events come from a log, not the queue */
+};
+
+/* tracing: the protocol's commentary (tprintf) and the emulator's own trace
+   lines are written through a per-simulation buffer, and only when TRACE is
+   at least the line's level, so a run at TRACE 0 pays a compare per trace
+   point and nothing else. build with -DTRACE_MAX=n to compile every level
+   above n out altogether. */
+#ifndef TRACE_MAX
+#define TRACE_MAX 3
+#endif
+#define TRACING(sim, level)  ((level) <= TRACE_MAX && (sim)->trace >= (level))
+#define tprintf(sim, ...) \
+   do { if (TRACING(sim, 1)) traceprintf(sim, __VA_ARGS__); } while (0)
+
+void starttimer(struct sim *sim, int AorB, float increment);
+void stoptimer(struct sim *sim, int AorB);
+struct timerh settimer(struct sim *sim, int AorB, float increment, int id);
+int canceltimer(struct sim *sim, struct timerh *h);
+int timerpending(struct timerh *h);
+void tolayer3(struct sim *sim, int AorB, struct pkt *packet);
+void tolayer5(struct sim *sim, int AorB, char *datasent, int len);
+void rttsample(struct sim *sim, struct rtoest *e, float rtt);
+void rttbackoff(struct sim *sim, struct rtoest *e);
+void rttrestore(struct sim *sim, struct rtoest *e);
+int rttspurious(struct sim *sim, struct rtoest *e, double resent);
+int pktchecksum(struct sim *sim, struct pkt *packet);
+void traceprintf(struct sim *sim, char *fmt, ...);
+void init(int argc, char *argv[]);
+void generate_next_arrival(struct sim *sim, int AorB);
+void insertevent(struct sim *sim, struct event *p);
+struct event *popevent(struct sim *sim);
+void removeevent(struct sim *sim, struct event *p);
+struct event *firstevent(struct sim *sim);
+struct event *nextevent(struct sim *sim, struct event *q);
+struct event *allocevent(struct sim *sim);
+void freeevent(struct sim *sim, struct event *p);
+struct pkt *allocpkt(struct sim *sim);
+struct pkt *holdpkt(struct pkt *packet);
+void freepkt(struct sim *sim, struct pkt *packet);
+char *allocmsg(struct sim *sim);
+void freemsg(struct sim *sim, char *data);
+void dropmsg(struct sim *sim, char *data);
+void lostmsg(struct sim *sim, int AorB);
+int sendqput(struct sim *sim, int AorB, struct msg message);
+int sendqget(struct sim *sim, int AorB, struct msg *message);
+
+/********* STUDENT CODE START *********/
+
+#define ENTITY_A 0
+#define ENTITY_B 1
+#define TIMEOUT_LEN 200.0 /* timeout for retransmission, same as GBN's so the
+                             two can be compared like for like */
+#define SR_WINSIZE 8  /* window used unless one is given on the command line */
+
+/* one slot of A's send window */
+struct A_slot {
+  struct pkt *packet;  // let go once ACKed
+  double senttime;    // when packet was last sent
+  struct timerh timer; // resends packet unless ACKed first
+  int resent;         // sent more than once, so its ACK can't be timed (Karn)
+  int acked;
+};
+
+/* like GBN, the send window is a ring buffer of the packets base..nextseq-1,
+packet seq in slot seq % winsize. unlike GBN every packet is ACKed and
+resent on its own, with a timer of its own whose id is its seqnum */
+struct A_state {
+  int base;       // oldest un-ACKed packet
+  int nextseq;
+  int winsize;    // slots in sendwin, the largest window A may use
+  float cwnd;     // window with AIMD on: +1 per window ACKed, halved on timeout
+  struct msg msg; // message being split into packets, data is NULL if none
+  int msgsent;    // bytes of msg sent so far
+  struct A_slot sendwin[];
+};
+
+/* B buffers packets that arrive out of order, packet seq in slot
+seq % winsize, and hands them to layer 5 once the gap before them fills.
+a buffered packet is held rather than copied, the slot is NULL until then */
+struct B_state {
+  int rcvbase;    // next packet to deliver to layer 5
+  int winsize;
+  char *msgbuf;   // the message being put back together
+  int msgfill;    // bytes of it received so far
+  struct pkt *rcvwin[];
+};
+
+/* fills in a packet and its checksum, copying len bytes of payload into
+the packet's own. payload is NULL (and len 0) for a packet with no payload */
+void fill_pkt(struct sim *sim, struct pkt *packet, int seqnum, int acknum, char *payload, int len, int msglen)
+{
+  packet->seqnum = seqnum;
+  packet->acknum = acknum;
+  packet->len = len;
+  packet->msglen = msglen;
+  if (len > 0)
+  {
+    memcpy(packet->payload, payload, len);
+  }
+  packet->checksum = pktchecksum(sim, packet);
+}
+
+struct pkt *make_pkt(struct sim *sim, int seqnum, int acknum, char *payload, int len, int msglen)
+{
+  struct pkt *packet = allocpkt(sim);
+  fill_pkt(sim, packet, seqnum, acknum, payload, len, msglen);
+  return packet;
+}
+
+/* returns 1 if a packet is corrupt, 0 otherwise */
+int pkt_is_corrupt(struct sim *sim, struct pkt *packet)
+{
+  return packet->checksum != pktchecksum(sim, packet);
+}
+
+/* the number of packets A may have un-ACKed right now */
+int A_window(struct sim *sim, struct A_state *A)
+{
+  if (sim->aimd && (int)A->cwnd < A->winsize)
+  {
+    return (int)A->cwnd;
+  }
+  return A->winsize;
+}
+
+/* prints A's send window from base up: seqnums of un-ACKed packets, A for
+ACKed ones, N for free slots */
+void win_info(struct sim *sim, struct A_state *A)
+{
+  if (!TRACING(sim, 1))
+    return;
+  tprintf(sim, "sendwin: [");
+  for (int seq = A->base; seq < A->base + A_window(sim, A); seq++)
+  {
+    if (seq >= A->nextseq) // empty
+    {
+      tprintf(sim, " N");
+    }
+    else if (A->sendwin[seq % A->winsize].acked)
+    {
+      tprintf(sim, " A");
+    }
+    else
+    {
+      tprintf(sim, " %d", seq);
+    }
+  }
+  tprintf(sim, " ]\n");
+}
+
+/* starts splitting up the next message waiting in A's send queue,
+returns 0 if there is none */
+int A_nextmsg(struct sim *sim, struct A_state *A)
+{
+  if (!sendqget(sim, ENTITY_A, &A->msg))
+  {
+    return 0;
+  }
+  A->msgsent = 0;
+  tprintf(sim, "A takes the next Layer 5 message off its send queue.\n");
+  return 1;
+}
+
+/* sends as many packets of the message being split up, and then of the
+queued ones, as the window allows */
+void A_send(struct sim *sim, struct A_state *A)
+{
+  while (A->nextseq < A->base + A_window(sim, A) && (A->msg.data != NULL || A_nextmsg(sim, A)))
+  {
+    // the window keeps the packet until it is ACKed, layer 3 shares it.
+    // for now, acknum will be zero because A is strictly a sender
+    struct A_slot *slot = &A->sendwin[A->nextseq % A->winsize];
+    int len = A->msg.len - A->msgsent < sim->mss ? A->msg.len - A->msgsent : sim->mss;
+    slot->packet = make_pkt(sim, A->nextseq, 0, A->msg.data + A->msgsent, len, A->msg.len);
+    A->msgsent += len;
+    if (A->msgsent == A->msg.len)  // last piece, the packets hold all of it now
+    {
+      freemsg(sim, A->msg.data);
+      A->msg.data = NULL;
+    }
+    slot->senttime = sim->time;
+    slot->resent = 0;
+    slot->acked = 0;
+    tprintf(sim, "A sends PKT %d into the network and starts its timer.\n", A->nextseq);
+    slot->timer = settimer(sim, ENTITY_A, sim->rtt[ENTITY_A].rto, A->nextseq);
+    A->nextseq++;
+    win_info(sim, A);
+
+    tolayer3(sim, ENTITY_A, slot->packet);
+  }
+}
+
+/* called from layer 5, passed the data to be sent to other side */
+void A_output(struct sim *sim, struct msg message)
+{
+  struct A_state *A = sim->Astate;
+
+  if (A->msg.data == NULL && A->nextseq < A->base + A_window(sim, A))  // there is space in sendwin
+  {
+    A->msg = message;
+    A->msgsent = 0;
+    A_send(sim, A);
+  }
+  else if (sendqput(sim, ENTITY_A, message))
+  {
+    tprintf(sim, "A can't send it yet, A queues Layer 5 message.\n");
+  }
+  else if (A->msg.data != NULL) // still splitting up the last one
+  {
+    tprintf(sim, "A is still sending its last message, A drops Layer 5 message.\n");
+    dropmsg(sim, message.data);
+  }
+  else // exceeds sending window
+  {
+    tprintf(sim, "A's sending window is full, A drops Layer 5 message.\n");
+    dropmsg(sim, message.data);
+  }
+}
+
+/* Note that with simplex transfer from a-to-B, there is no B_output() */
+void B_output(struct sim *sim, struct msg message)  
+{
+  dropmsg(sim, message.data);
+}
+
+/* called from layer 3, when a packet arrives for layer 4 */
+void A_input(struct sim *sim, struct pkt *packet)
+{
+  struct A_state *A = sim->Astate;
+
+  if (pkt_is_corrupt(sim, packet))
+  {
+    tprintf(sim, "A receives a corrupt ACK, A does nothing.\n");
+    return;
+  }
+  if (packet->acknum < A->base || packet->acknum >= A->nextseq)
+  {
+    tprintf(sim, "A receives ACK %d, which falls outside of the sending window; A does nothing.\n", packet->acknum);
+    return;
+  }
+  struct A_slot *acked = &A->sendwin[packet->acknum % A->winsize];
+  if (acked->acked)
+  {
+    tprintf(sim, "A receives duplicate ACK %d, A does nothing.\n", packet->acknum);
+    return;
+  }
+
+  tprintf(sim, "A receives ACK %d, which is new. A stops its timer.\n", packet->acknum);
+  acked->acked = 1;
+  canceltimer(sim, &acked->timer);
+  freepkt(sim, acked->packet);
+  acked->packet = NULL;
+
+  // time the round trip of the ACKed packet if it was only sent once.
+  // a resent packet can't be timed, but an ACK quicker than any round trip
+  // shows it was resent for nothing
+  if (!acked->resent)
+  {
+    rttsample(sim, &sim->rtt[ENTITY_A], sim->time - acked->senttime);
+  }
+  else if (rttspurious(sim, &sim->rtt[ENTITY_A], acked->senttime))
+  {
+    tprintf(sim, "A's resend of PKT %d was spurious.\n", packet->acknum);
+  }
+
+  // additive increase, one packet per window's worth of ACKs
+  if (sim->aimd)
+  {
+    A->cwnd += 1 / A->cwnd;
+    if (A->cwnd > A->winsize)
+    {
+      A->cwnd = A->winsize;
+    }
+    sim->window = A_window(sim, A);
+  }
+
+  // slide the window past every ACKed packet at its start
+  while (A->base < A->nextseq && A->sendwin[A->base % A->winsize].acked)
+  {
+    A->base++;
+  }
+
+  // the window may have room again for the rest of a message
+  A_send(sim, A);
+}
+
+/* called when the timer of packet timerid goes off */
+void A_timerinterrupt(struct sim *sim, int timerid)
+{
+  struct A_state *A = sim->Astate;
+  int seq = timerid;
+
+  if (seq < A->base || seq >= A->nextseq || A->sendwin[seq % A->winsize].acked)
+  {
+    return; // ACKed since, nothing to do
+  }
+  struct A_slot *slot = &A->sendwin[seq % A->winsize];
+  tprintf(sim, "A's timer for PKT %d has timed out.\n", seq);
+
+  // the oldest packet timing out is what a single-timer sender would see:
+  // back off and halve the window once for it, not for every packet behind
+  if (seq == A->base)
+  {
+    rttbackoff(sim, &sim->rtt[ENTITY_A]);
+    if (sim->aimd)
+    {
+      A->cwnd = A->cwnd / 2 < 1 ? 1 : A->cwnd / 2;
+      sim->window = A_window(sim, A);
+      tprintf(sim, "A halves its window to %d.\n", A_window(sim, A));
+    }
+  }
+
+  tprintf(sim, "A resends PKT %d and restarts its timer.\n", seq);
+  slot->senttime = sim->time;
+  slot->resent = 1;
+  sim->nretransmit++;
+  slot->timer = settimer(sim, ENTITY_A, sim->rtt[ENTITY_A].rto, seq);
+  tolayer3(sim, ENTITY_A, slot->packet);
+}  
+
+/* the following routine will be called once (only) before any other */
+/* entity A routines are called. You can use it to do any initialization */
+void A_init(struct sim *sim)
+{
+  // use our own window and timeout unless given on the command line
+  if (sim->winsize <= 0)
+  {
+    sim->winsize = SR_WINSIZE;
+  }
+  if (sim->timeoutlen <= 0.0)
+  {
+    sim->timeoutlen = TIMEOUT_LEN;
+  }
+  // where adaptive timeouts start. B never sends data, so its stays put
+  sim->rtt[ENTITY_A].rto = sim->rtt[ENTITY_B].rto = sim->timeoutlen;
+
+  struct A_state *A = calloc(1, sizeof(struct A_state) + sim->winsize * sizeof(struct A_slot));
+  A->base = 1;
+  A->nextseq = 1;
+  A->winsize = sim->winsize;
+  A->cwnd = 1;
+  sim->Astate = A;
+  sim->window = A_window(sim, A);
+}
+
+/* hands the payload of an in-order packet to the message B is putting back
+together, and the message to layer 5 once it is whole. a message that fits
+in one packet goes up straight from the packet, without a copy */
+void B_deliver(struct sim *sim, struct B_state *B, struct pkt *packet)
+{
+  if (B->msgfill == 0 && packet->len == packet->msglen)
+  {
+    tolayer5(sim, ENTITY_B, packet->payload, packet->len);
+    return;
+  }
+  if (packet->msglen > sim->msgsize || B->msgfill + packet->len > packet->msglen)
+  {
+    tprintf(sim, "B's packet doesn't fit the message, B starts over.\n");
+    lostmsg(sim, ENTITY_B);
+    B->msgfill = 0;
+    return;
+  }
+  memcpy(B->msgbuf + B->msgfill, packet->payload, packet->len);
+  B->msgfill += packet->len;
+  if (B->msgfill == packet->msglen)
+  {
+    tolayer5(sim, ENTITY_B, B->msgbuf, packet->msglen);
+    B->msgfill = 0;
+  }
+}
+
+/* called from layer 3, when a packet arrives for layer 4 at B*/
+void B_input(struct sim *sim, struct pkt *packet)
+{
+  struct B_state *B = sim->Bstate;
+
+  if (pkt_is_corrupt(sim, packet))
+  {
+    // A resends it when its timer for the packet runs out
+    tprintf(sim, "B receives a corrupt packet, B does nothing.\n");
+    return;
+  }
+
+  if (packet->seqnum >= B->rcvbase && packet->seqnum < B->rcvbase + B->winsize)
+  {
+    struct pkt **slot = &B->rcvwin[packet->seqnum % B->winsize];
+    if (*slot != NULL)
+    {
+      tprintf(sim, "B receives PKT %1$d again, sends ACK %1$d.\n", packet->seqnum);
+    }
+    else if (packet->seqnum != B->rcvbase)
+    {
+      // keep the packet itself until the gap before it fills
+      tprintf(sim, "B receives out of order PKT %1$d, buffers it and sends ACK %1$d.\n", packet->seqnum);
+      *slot = holdpkt(packet);
+    }
+    else
+    {
+      // in order, so it goes up straight from the packet
+      tprintf(sim, "B receives PKT %1$d, sends ACK %1$d.\n", packet->seqnum);
+      B_deliver(sim, B, packet);
+      B->rcvbase++;
+    }
+
+    // deliver everything that is now in order
+    while (B->rcvwin[B->rcvbase % B->winsize] != NULL)
+    {
+      struct pkt **next = &B->rcvwin[B->rcvbase % B->winsize];
+      B_deliver(sim, B, *next);
+      freepkt(sim, *next);
+      *next = NULL;
+      B->rcvbase++;
+    }
+  }
+  else if (packet->seqnum >= B->rcvbase - B->winsize && packet->seqnum < B->rcvbase)
+  {
+    // delivered already, but A can't know that if our ACK got lost
+    tprintf(sim, "B receives old PKT %1$d, sends ACK %1$d again.\n", packet->seqnum);
+  }
+  else
+  {
+    tprintf(sim, "B receives PKT %d, outside of its window; B does nothing.\n", packet->seqnum);
+    return;
+  }
+
+  // for now, seqnum will be zero because B is strictly a receiver.
+  // layer 3 keeps its own reference to the ACK, ours goes right away
+  struct pkt *ack = make_pkt(sim, 0, packet->seqnum, NULL, 0, 0);
+  tolayer3(sim, ENTITY_B, ack);
+  freepkt(sim, ack);
+}
+
+/* called when B's timer goes off. B never sets one: it ACKs each packet
+as it arrives and keeps no packets of its own to resend */
+void B_timerinterrupt(struct sim *sim, int timerid)
+{
+  (void)sim;
+  (void)timerid;
+}
+
+/* the following rouytine will be called once (only) before any other */
+/* entity B routines are called. You can use it to do any initialization */
+void B_init(struct sim *sim)
+{
+  // B's window matches A's, which A_init has settled on by now
+  int winsize = sim->winsize > 0 ? sim->winsize : SR_WINSIZE;
+  struct B_state *B = calloc(1, sizeof(struct B_state) + winsize * sizeof(struct pkt *));
+  B->rcvbase = 1;
+  B->winsize = winsize;
+  B->msgbuf = allocmsg(sim);
+  sim->Bstate = B;
+}
+
+/********* STUDENT CODE END *********/
+
+/*****************************************************************
+***************** NETWORK EMULATION CODE STARTS BELOW ***********
+The code below emulates the layer 3 and below network environment:
+  - emulates the tranmission and delivery (possibly with bit-level corruption
+    and packet loss) of packets across the layer 3/4 interface
+  - handles the starting/stopping of a timer, and generates timer
+    interrupts (resulting in calling students timer handler).
+  - generates message to be sent (passed from later 5 to 4)
+
+THERE IS NOT REASON THAT ANY STUDENT SHOULD HAVE TO READ OR UNDERSTAND
+THE CODE BELOW.  YOU SHOLD NOT TOUCH, OR REFERENCE (in your code) ANY
+OF THE DATA STRUCTURES BELOW.  If you're interested in how I designed
+the emulator, you're welcome to look at the code - but again, you should have
+to, and you defeinitely should not have to modify
+******************************************************************/
+
+/* the pending events are kept by one of two interchangeable schedulers:
+   the original sorted doubly-linked list (O(n) insert) or a binary heap
+   (O(log n) insert/remove). build with -DSCHEDULER=LIST_SCHEDULER to get
+   the list back. both hand out events in exactly the same order.
+   timer events, which are mostly cancelled long before they would go off,
+   go into the timer wheel instead and popevent() takes whichever of the two
+   has the earlier event. build with -DTIMERWHEEL=0 to queue them with the
+   rest. */
+#define  LIST_SCHEDULER  0
+#define  HEAP_SCHEDULER  1
+#ifndef SCHEDULER
+#define  SCHEDULER       HEAP_SCHEDULER
+#endif
+#ifndef TIMERWHEEL
+#define  TIMERWHEEL      1
+#endif
+#define  WHEELED(p)      (TIMERWHEEL && (p)->evtype==TIMER_INTERRUPT)
+
+/* possible events: */
+#define  TIMER_INTERRUPT 0  
+#define  FROM_LAYER5     1
+#define  FROM_LAYER3     2
+
+#define  OFF             0
+#define  ON              1
+#define   A    0
+#define   B    1
+
+#define  MSGSIZE         20        /* default message size and MSS, as originally */
+#define  MSSMAX          65535     /* largest MSS */
+
+/* the parameters a simulation is started with */
+struct simparams {
+   int nsimmax;               /* number of msgs to generate, then stop */
+   float lossprob;            /* probability that a packet is dropped  */
+   float corruptprob;         /* probability that one bit is packet is flipped */
+   float lambda;              /* arrival rate of messages from layer 5 */
+   float timeoutlen;          /* retransmission timeout, 0.0 for the protocol's */
+   int winsize;               /* send window, 0 for the protocol's */
+   int aimd;                  /* adaptive window */
+   int adaptive;              /* adaptive timeout */
+   int cksum;                 /* checksum, CK_* */
+   int msgsize;               /* bytes per message from layer 5 */
+   int msgmin;                /* shortest message, 0 for all msgsize */
+   int mss;                   /* most payload bytes per packet */
+   float bandwidth[2];        /* of the link out of A, out of B, 0.0 for none */
+   float propdelay[2];
+   int qlimit[2];             /* bytes each link's queue holds, 0 for no limit */
+   int qdisc;                 /* QD_* */
+   int duplex;
+   float ackdelay;
+   int dupthresh;             /* 0 for no fast retransmit */
+   int sendqlen;              /* messages each send queue holds, 0 for none */
+   int sqpolicy;              /* SQ_* */
+   int trace;                 /* for my debugging */
+   unsigned int seed;         /* random number generator seed */
+   char *tracefile;           /* binary trace file, NULL for text on stdout */
+   char *evlogfile;           /* log every event to this file */
+   char *replayfile;          /* replay the events logged in this file */
+};
+/* fields not named here start at 0, 0.0 or NULL */
+struct simparams params = {.cksum = CK_SUM, .msgsize = MSGSIZE, .mss = MSGSIZE,
+                           .qdisc = QD_DROPTAIL, .duplex = BIDIRECTIONAL,
+                           .sqpolicy = SQ_DROP, .trace = 1, .seed = 9999};
+char *cksumnames[NCKSUMS] = {"sum", "inet", "crc32c"};
+char *qdiscnames[NQDISCS] = {"droptail", "red"};
+char *sqpolicynames[NSQPOLICIES] = {"drop", "block"};
+int batch = 0;             /* parameters given on the command line, no prompts */
+
+/* parameter sweeps: loss, corrupt, avgtime, timeout, window, msgsize, bandwidth, sendq,
+   ackdelay and dupthresh may each
+   be given a comma separated list of values, and every combination of them is run
+   "repeat" times (with seeds seed, seed+1, ...). the runs are independent
+   simulations, so they are spread over "jobs" threads. */
+#define MAXSWEEP 32
+
+struct sweepdim {
+   int n;                      /* number of values given */
+   float v[MAXSWEEP];
+};
+struct sweepdim sweeploss, sweepcorrupt, sweepavgtime, sweeptimeout, sweepwindow, sweepmsgsize;
+struct sweepdim sweepbandwidth;   /* of the link out of A */
+struct sweepdim sweepsendq, sweepackdelay, sweepdupthresh;
+float sweepbandwidthba[MAXSWEEP]; /* out of B, one for each of sweepbandwidth's */
+int nrepeat = 1;           /* runs per parameter combination */
+int njobs = 0;             /* worker threads, 0 for one per cpu */
+char *sweepout = NULL;     /* results file, .json for JSON, else CSV */
+
+struct runresult {
+   struct simparams p;
+   double time;
+   int nsim, ntolayer3, nlost, ncorrupt, ndelivered, nretransmit, nspurious, nqdrop;
+   int nmsgdrop, nackpkts, npiggyback, nfastretx, ntimeoutsaved;
+   float avgwindow;
+   float util;                 /* of the link out of A */
+   float p50, p99, p999;       /* delivery latency percentiles */
+   float sqdepth, blocked;     /* of A's send queue */
+};
+
+struct sim *newsim(struct simparams *p);
+void freesim(struct sim *sim);
+void simulate(struct sim *sim);
+void printsummary(struct sim *sim);
+void printpoolstats(char *name, struct pool *pl);
+void runsweep();
+float jimsrand(struct sim *sim, int stream);
+int msglength(struct sim *sim);
+void poolrelease(struct pool *pl);
+void stamppush(struct stampq *q, int64_t t);
+int stamppop(struct stampq *q, int64_t *t);
+float sendqdepth(struct sim *sim, int AorB);
+float sendqblocked(struct sim *sim, int AorB);
+double hdrpercentile(struct hdrhist *h, double p);
+
+/* every trace line is a record: the emulator's are a kind plus a few
+   numbers, the protocol's (and the warnings) are text. records are
+   formatted as they are written, or with -b written as they are to a file
+   for -p to format later, which gives the exact same text. */
+#define  TR_TEXT        0   /* free text, len bytes of it follow */
+#define  TR_EVENT       1   /* event taken off the queue, a = its type */
+#define  TR_MSG         2   /* message handed to layer 4, data follows */
+#define  TR_ARRIVAL     3   /* next message arrival being generated */
+#define  TR_INSERT      4   /* event inserted, x = its time */
+#define  TR_STOPTIMER   5
+#define  TR_STARTTIMER  6
+#define  TR_LOST        7   /* packet lost by layer 3 */
+#define  TR_SEND        8   /* packet into layer 3, a/b/c = seq/ack/check, */
+                            /* payload follows */
+#define  TR_CORRUPT     9   /* packet corrupted by layer 3 */
+#define  TR_SCHEDULE   10   /* packet arrival scheduled */
+#define  TR_DELIVER    11   /* data delivered to layer 5, data follows */
+#define  TR_QDROP      12   /* packet dropped by a link's queue */
+#define  TR_BLOCK      13   /* layer 5 waits for room in a send queue */
+
+#define  TRACEMAGIC     "SIMTRC2\n"
+#ifndef TRACEBUFSIZE
+#define  TRACEBUFSIZE   (256*1024)
+#endif
+#define  TRACELINEMAX   1024  /* longer protocol lines are cut short */
+#define  TRACEDATAMAX   20    /* bytes of a message or payload traced */
+
+struct tracerec {             /* written in host byte order */
+   int64_t time;              /* simulation time of the record, in ticks */
+   int64_t x;                 /* a time too, in ticks */
+   int a, b, c;
+   unsigned char kind;        /* TR_... */
+   unsigned char entity;
+   unsigned short len;        /* bytes of data that follow */
+};
+
+struct tracebuf {
+   FILE *fp;
+   int binary;                /* write tracerec's instead of text */
+   size_t used;
+   char buf[TRACEBUFSIZE];
+};
+
+void traceopen(struct sim *sim, char *tracefile);
+void traceflush(struct sim *sim);
+void traceclose(struct sim *sim);
+void tracerecord(struct sim *sim, int kind, int entity, int a, int b, int c,
+                 int64_t x, char *data, int len);
+void tracedump(char *tracefile);
+void evlogopen(struct sim *sim, char *evlogfile, char *replayfile);
+void evlogheader(struct sim *sim);
+void evlogclose(struct sim *sim);
+void evlogevent(struct sim *sim, struct event *ev);
+void evlogdraw(struct sim *sim, int stream, uint32_t bits);
+struct event *replayevent(struct sim *sim);
+void timerfired(struct sim *sim, struct event *ev);
+int evlogdiff(char *file1, char *file2);
+
+/* an emulator trace record (kind TR_...), if TRACE is at least level */
+#define TRACEREC(sim, level, ...) \
+   do { if (TRACING(sim, level)) tracerecord(sim, __VA_ARGS__); } while (0)
+
+int main(int argc, char *argv[])
+{
+   struct sim *sim;
+
+   init(argc, argv);
+   if (sweepout!=NULL) {
+      runsweep();
+      return(0);
+      }
+   sim = newsim(&params);
+   A_init(sim);
+   B_init(sim);
+   simulate(sim);
+   traceflush(sim);
+
+   printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n",
+          sim->time,sim->nsim);
+   if (sim->latency.n > 0)
+      printf(" latency of %ld msgs delivered: p50 %f, p99 %f, p99.9 %f, max %f\n",
+             sim->latency.n, hdrpercentile(&sim->latency, 50.0),
+             hdrpercentile(&sim->latency, 99.0), hdrpercentile(&sim->latency, 99.9),
+             TICKTIME(sim->latency.max));
+   printpoolstats("events", &sim->eventpool);
+   printpoolstats("packets", &sim->pktpool);
+   printpoolstats("messages", &sim->msgpool);
+   if (batch)
+      printsummary(sim);
+   freesim(sim);
+   return(0);
+}
+
+void simulate(struct sim *sim)
+{
+   struct event *eventptr;
+   struct msg  msg2give;
+   int nmsgdrop, blocked;
+   
+   evlogheader(sim);   /* now that A_init() and B_init() have run */
+   while (1) {
+        if (sim->replay)                 /* get next event to simulate */
+           eventptr = replayevent(sim);
+        else
+           eventptr = popevent(sim);
+        if (eventptr==NULL)
+           return;
+        sim->windowtime += sim->window * TICKTIME(eventptr->evtime - sim->now);
+        sim->now = eventptr->evtime;    /* update time to next event time */
+        sim->time = TICKTIME(sim->now);
+        TRACEREC(sim, 2, TR_EVENT, eventptr->eventity, eventptr->evtype, 0, 0, 0.0, NULL, 0);
+        if (sim->evlog!=NULL)
+           evlogevent(sim, eventptr);
+        if (sim->nsim==sim->nsimmax) {
+          freeevent(sim, eventptr);
+	  break;                        /* all done with simulation */
+          }
+        if (eventptr->evtype == FROM_LAYER5 ) {
+            blocked = sim->sqpolicy==SQ_BLOCK && sim->sendqlen > 0 &&
+                      sim->sendq[eventptr->eventity].n==sim->sendqlen;
+            if (!blocked)   /* else none arrive until the queue has room */
+               generate_next_arrival(sim, eventptr->eventity);   /* set up future arrival */
+            /* fill in msg to give with string of same letter */    
+            msg2give.len = msglength(sim);
+            msg2give.data = allocmsg(sim);
+            memset(msg2give.data, 97 + sim->nsim % 26, msg2give.len);
+            TRACEREC(sim, 3, TR_MSG, eventptr->eventity, 0, 0, 0, 0.0,
+                     msg2give.data, msg2give.len);
+            sim->nsim++;
+            nmsgdrop = sim->nmsgdrop;
+            if (blocked) {   /* layer 5 waits, see sendqget() */
+               TRACEREC(sim, 2, TR_BLOCK, eventptr->eventity, 0, 0, 0, 0.0, NULL, 0);
+               sim->sendq[eventptr->eventity].held = msg2give;
+               sim->sendq[eventptr->eventity].heldsince = sim->now;
+               }
+            else if (eventptr->eventity == A) 
+               A_output(sim, msg2give);  
+             else
+               B_output(sim, msg2give);  
+            if (sim->nmsgdrop==nmsgdrop)  /* taken, so it will be delivered */
+               stamppush(&sim->sent[eventptr->eventity], sim->now);
+            }
+          else if (eventptr->evtype ==  FROM_LAYER3) {
+	    if (eventptr->eventity ==A)      /* deliver packet by calling */
+   	       A_input(sim, eventptr->pktptr);   /* appropriate entity */
+            else
+   	       B_input(sim, eventptr->pktptr);
+	    freepkt(sim, eventptr->pktptr);  /* drop layer 3's reference */
+            }
+          else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+            timerfired(sim, eventptr);
+            if (eventptr->eventity == A) 
+	       A_timerinterrupt(sim, eventptr->timerid);
+             else
+	       B_timerinterrupt(sim, eventptr->timerid);
+             }
+          else  {
+	     printf("INTERNAL PANIC: unknown event type \n");
+             }
+        freeevent(sim, eventptr);
+        }
+}
+
+
+
+/* batch mode: the parameters init() would prompt for can instead be given
+   on the command line, or in a config file of "key value" lines with the
+   keys below ('#' starts a comment). later settings override earlier ones,
+   so a file can hold defaults that flags after it tweak. the seed may also
+   come from the SIM_SEED environment variable. */
+void usage(char *prog)
+{
+   printf("usage: %s [-f file] [-n msgs] [-l loss] [-c corrupt] [-a avgtime]\n", prog);
+   printf("          [-T timeout] [-w window] [-A aimd] [-E adaptive] [-k checksum] [-m msgsize]\n");
+   printf("          [-i msgmin] [-M mss]\n");
+   printf("          [-B bandwidth] [-D propdelay] [-Q queue] [-q qdisc] [-S sendq] [-P policy]\n");
+   printf("          [-F duplex] [-K ackdelay] [-U dupthresh]\n");
+   printf("          [-t trace] [-b tracefile] [-e eventlog] [-R eventlog]\n");
+   printf("          [-s seed] [-r repeat] [-j jobs] [-o out]\n");
+   printf("       %s -p tracefile\n", prog);
+   printf("       %s -d eventlog eventlog\n", prog);
+   printf("  -f file     read \"key value\" settings from file, keys are messages,\n");
+   printf("              loss, corrupt, avgtime, timeout, window, aimd, adaptive,\n");
+   printf("              checksum, msgsize, msgmin, mss, bandwidth, propdelay, queue,\n");
+   printf("              qdisc, sendq, sqpolicy, duplex, ackdelay, dupthresh,\n");
+   printf("              trace, binary, eventlog, replay,\n");
+   printf("              seed, repeat, jobs and output\n");
+   printf("  -n msgs     number of messages to simulate\n");
+   printf("  -l loss     packet loss probability\n");
+   printf("  -c corrupt  packet corruption probability\n");
+   printf("  -a avgtime  average time between messages from sender's layer5\n");
+   printf("  -T timeout  retransmission timeout (default: the protocol's own)\n");
+   printf("  -w window   send window (default: the protocol's own)\n");
+   printf("  -A 0|1      adapt the window to ACKs and timeouts (AIMD), up to -w\n");
+   printf("  -E 0|1      estimate the timeout from measured RTTs, starting at -T\n");
+   printf("  -k name     packet checksum: sum (default), inet or crc32c\n");
+   printf("  -m bytes    size of each message from layer 5 (default %d)\n", MSGSIZE);
+   printf("  -i bytes    vary message sizes, uniformly from this up to -m\n");
+   printf("  -M bytes    most payload bytes per packet, messages are split into\n");
+   printf("              packets of this size (default %d)\n", MSGSIZE);
+   printf("  -B rate     link bandwidth in bytes per time unit (default: none, each\n");
+   printf("              packet takes 1 to 10 time units at random)\n");
+   printf("  -D time     link propagation delay\n");
+   printf("  -Q bytes    link queue size (default: no limit)\n");
+   printf("  -q name     link queue discipline: droptail (default) or red\n");
+   printf("              -B, -D and -Q take x/y for x out of A and y out of B\n");
+   printf("  -S msgs     messages the sender queues while it can't send them\n");
+   printf("              (default 0: they are dropped)\n");
+   printf("  -P name     full send queue: drop (default) the message, or block\n");
+   printf("              layer 5 until there is room\n");
+   printf("  -F 0|1      messages arrive at B for A as well (full duplex)\n");
+   printf("  -K time     longest a receiver holds back an ACK to send it on data\n");
+   printf("              (default 0: ACK at once)\n");
+   printf("  -U acks     Go-Back-N resends its window on this many duplicate ACKs\n");
+   printf("              (default 0: only on timeouts)\n");
+   printf("  -t trace    TRACE level\n");
+   printf("  -b file     write the trace to file as binary records, not text\n");
+   printf("  -p file     print the binary trace in file as text, then exit\n");
+   printf("  -e file     log every event, its packet and random numbers to file\n");
+   printf("  -R file     replay the events logged in file instead of simulating\n");
+   printf("  -d f1 f2    compare two event logs, then exit\n");
+   printf("  -s seed     random number generator seed (default $SIM_SEED or 9999)\n");
+   printf("sweeps: -l, -c, -a, -T, -w, -m, -B, -S, -K and -U also take comma separated lists of values\n");
+   printf("  -r repeat   runs per combination of values, seeds seed, seed+1, ...\n");
+   printf("  -j jobs     simulations to run at once (default: one per cpu)\n");
+   printf("  -o out      write one row per run to out (.json for JSON, else CSV)\n");
+   printf("with no arguments the parameters are prompted for.\n");
+   exit(1);
+}
+
+/* a list longer than a sweep dimension holds is an error, not cut short */
+void sweeptoolong(char *value)
+{
+   printf("at most %d values can be swept per parameter: %s\n", MAXSWEEP, value);
+   exit(1);
+}
+
+/* parse a comma separated list of values, returns the first one */
+float setsweep(struct sweepdim *dim, char *value)
+{
+   char *p = value;
+
+   dim->n = 0;
+   while (1) {
+      if (dim->n==MAXSWEEP)
+         sweeptoolong(value);
+      dim->v[dim->n++] = strtod(p, &p);
+      if (*p!=',')
+         break;
+      p++;
+      }
+   return(dim->v[0]);
+}
+
+/* parse "x" or "x/y", one value for the link out of A and one for the
+   link out of B, x for both if there is no y. returns the end of it */
+char *setlink(float v[2], char *value)
+{
+   char *p;
+
+   v[0] = v[1] = strtod(value, &p);
+   if (*p=='/')
+      v[1] = strtod(p+1, &p);
+   return(p);
+}
+
+/* a comma separated list of link values, see setlink(). the first goes
+   into v */
+void setlinksweep(struct sweepdim *ab, float *ba, char *value, float v[2])
+{
+   char *p = value;
+
+   ab->n = 0;
+   while (1) {
+      if (ab->n==MAXSWEEP)
+         sweeptoolong(value);
+      p = setlink(v, p);
+      ba[ab->n] = v[1];
+      ab->v[ab->n++] = v[0];
+      if (*p!=',')
+         break;
+      p++;
+      }
+   v[0] = ab->v[0];
+   v[1] = ba[0];
+}
+
+/* set one parameter by name, returns 0 if the name is not known */
+int setparam(char *key, char *value)
+{
+   float v[2];
+
+   if (strcmp(key, "messages")==0 || strcmp(key, "n")==0)
+      params.nsimmax = atoi(value);
+   else if (strcmp(key, "loss")==0 || strcmp(key, "l")==0)
+      params.lossprob = setsweep(&sweeploss, value);
+   else if (strcmp(key, "corrupt")==0 || strcmp(key, "c")==0)
+      params.corruptprob = setsweep(&sweepcorrupt, value);
+   else if (strcmp(key, "avgtime")==0 || strcmp(key, "a")==0)
+      params.lambda = setsweep(&sweepavgtime, value);
+   else if (strcmp(key, "timeout")==0 || strcmp(key, "T")==0)
+      params.timeoutlen = setsweep(&sweeptimeout, value);
+   else if (strcmp(key, "window")==0 || strcmp(key, "w")==0)
+      params.winsize = (int)setsweep(&sweepwindow, value);
+   else if (strcmp(key, "aimd")==0 || strcmp(key, "A")==0)
+      params.aimd = atoi(value);
+   else if (strcmp(key, "adaptive")==0 || strcmp(key, "E")==0)
+      params.adaptive = atoi(value);
+   else if (strcmp(key, "msgsize")==0 || strcmp(key, "m")==0)
+      params.msgsize = (int)setsweep(&sweepmsgsize, value);
+   else if (strcmp(key, "msgmin")==0 || strcmp(key, "i")==0)
+      params.msgmin = atoi(value);
+   else if (strcmp(key, "mss")==0 || strcmp(key, "M")==0)
+      params.mss = atoi(value);
+   else if (strcmp(key, "bandwidth")==0 || strcmp(key, "B")==0)
+      setlinksweep(&sweepbandwidth, sweepbandwidthba, value, params.bandwidth);
+   else if (strcmp(key, "propdelay")==0 || strcmp(key, "D")==0)
+      setlink(params.propdelay, value);
+   else if (strcmp(key, "queue")==0 || strcmp(key, "Q")==0) {
+      setlink(v, value);
+      params.qlimit[0] = (int)v[0];
+      params.qlimit[1] = (int)v[1];
+      }
+   else if (strcmp(key, "qdisc")==0 || strcmp(key, "q")==0) {
+      for (params.qdisc=0; params.qdisc<NQDISCS; params.qdisc++)
+         if (strcmp(value, qdiscnames[params.qdisc])==0)
+            break;
+      if (params.qdisc==NQDISCS)
+         return(0);
+      }
+   else if (strcmp(key, "duplex")==0 || strcmp(key, "F")==0)
+      params.duplex = atoi(value);
+   else if (strcmp(key, "ackdelay")==0 || strcmp(key, "K")==0)
+      params.ackdelay = setsweep(&sweepackdelay, value);
+   else if (strcmp(key, "dupthresh")==0 || strcmp(key, "U")==0)
+      params.dupthresh = (int)setsweep(&sweepdupthresh, value);
+   else if (strcmp(key, "sendq")==0 || strcmp(key, "S")==0)
+      params.sendqlen = (int)setsweep(&sweepsendq, value);
+   else if (strcmp(key, "sqpolicy")==0 || strcmp(key, "P")==0) {
+      for (params.sqpolicy=0; params.sqpolicy<NSQPOLICIES; params.sqpolicy++)
+         if (strcmp(value, sqpolicynames[params.sqpolicy])==0)
+            break;
+      if (params.sqpolicy==NSQPOLICIES)
+         return(0);
+      }
+   else if (strcmp(key, "checksum")==0 || strcmp(key, "k")==0) {
+      for (params.cksum=0; params.cksum<NCKSUMS; params.cksum++)
+         if (strcmp(value, cksumnames[params.cksum])==0)
+            break;
+      if (params.cksum==NCKSUMS)
+         return(0);
+      }
+   else if (strcmp(key, "repeat")==0 || strcmp(key, "r")==0)
+      nrepeat = atoi(value);
+   else if (strcmp(key, "jobs")==0 || strcmp(key, "j")==0)
+      njobs = atoi(value);
+   else if (strcmp(key, "output")==0 || strcmp(key, "o")==0)
+      sweepout = strdup(value);
+   else if (strcmp(key, "trace")==0 || strcmp(key, "t")==0)
+      params.trace = atoi(value);
+   else if (strcmp(key, "binary")==0 || strcmp(key, "b")==0)
+      params.tracefile = strdup(value);
+   else if (strcmp(key, "eventlog")==0 || strcmp(key, "e")==0)
+      params.evlogfile = strdup(value);
+   else if (strcmp(key, "replay")==0 || strcmp(key, "R")==0)
+      params.replayfile = strdup(value);
+   else if (strcmp(key, "seed")==0 || strcmp(key, "s")==0)
+      params.seed = (unsigned int)strtoul(value, NULL, 10);
+   else
+      return(0);
+   return(1);
+}
+
+void readconfig(char *filename)
+{
+   FILE *fp;
+   char line[256], key[64], value[64];
+   int lineno = 0;
+   char *p;
+
+   if ((fp = fopen(filename, "r"))==NULL) {
+      printf("cannot open config file %s\n", filename);
+      exit(1);
+      }
+   while (fgets(line, sizeof(line), fp)!=NULL) {
+      lineno++;
+      if ((p = strchr(line, '#'))!=NULL)
+         *p = '\0';
+      for (p = line; *p!='\0'; p++)   /* allow "key = value" too */
+         if (*p=='=')
+            *p = ' ';
+      if (sscanf(line, "%63s %63s", key, value)!=2)
+         continue;                  /* blank or comment line */
+      if (!setparam(key, value)) {
+         printf("%s:%d: unknown setting %s\n", filename, lineno, key);
+         exit(1);
+         }
+      }
+   fclose(fp);
+}
+
+void getparams(int argc, char *argv[])
+{
+   int i;
+
+   params.nsimmax = 10;            /* defaults for anything not given */
+   setparam("loss", "0.0");
+   setparam("corrupt", "0.0");
+   setparam("avgtime", "1000.0");
+   setparam("timeout", "0.0");
+   setparam("window", "0");
+   setparam("msgsize", "20");
+   setparam("bandwidth", "0");
+   setparam("sendq", "0");
+   setparam("ackdelay", "0.0");
+   setparam("dupthresh", "0");
+   params.trace = 0;
+   for (i=1; i<argc; i++) {
+      if (argv[i][0]!='-' || argv[i][1]=='\0' || argv[i][2]!='\0' || i+1==argc)
+         usage(argv[0]);
+      if (argv[i][1]=='f')
+         readconfig(argv[i+1]);
+      else if (argv[i][1]=='p') {
+         tracedump(argv[i+1]);
+         exit(0);
+         }
+      else if (argv[i][1]=='d') {
+         if (i+2==argc)
+            usage(argv[0]);
+         exit(evlogdiff(argv[i+1], argv[i+2]));
+         }
+      else if (!setparam(argv[i]+1, argv[i+1]))
+         usage(argv[0]);
+      i++;
+      }
+   for (i=0; i<sweepavgtime.n; i++)
+      if (sweepavgtime.v[i] <= 0.0) {
+         printf("average time between messages must be > 0.0\n");
+         exit(1);
+         }
+   for (i=0; i<sweepmsgsize.n; i++)
+      if (sweepmsgsize.v[i] < 1) {
+         printf("message size must be at least 1\n");
+         exit(1);
+         }
+   for (i=0; i<sweepmsgsize.n; i++)
+      if (params.msgmin < 0 || params.msgmin > sweepmsgsize.v[i]) {
+         printf("shortest message size must be between 0 and the message size\n");
+         exit(1);
+         }
+   if (params.mss < 1 || params.mss > MSSMAX) {
+      printf("MSS must be between 1 and %d\n", MSSMAX);
+      exit(1);
+      }
+   for (i=0; i<sweepbandwidth.n; i++)
+      if (sweepbandwidth.v[i] < 0.0 || sweepbandwidthba[i] < 0.0) {
+         printf("bandwidth must be >= 0.0\n");
+         exit(1);
+         }
+   if (params.propdelay[0] < 0.0 || params.propdelay[1] < 0.0 ||
+       params.qlimit[0] < 0 || params.qlimit[1] < 0) {
+      printf("propagation delay and queue size must be >= 0\n");
+      exit(1);
+      }
+   for (i=0; i<2; i++)
+      if (params.qlimit[i] > 0 && params.qlimit[i] < LINKHDRBYTES + params.mss) {
+         printf("queue size must be 0 or at least %d bytes, one full packet\n",
+                LINKHDRBYTES + params.mss);
+         exit(1);
+         }
+   for (i=0; i<sweepsendq.n; i++)
+      if (sweepsendq.v[i] < 0) {
+         printf("send queue size must be >= 0\n");
+         exit(1);
+         }
+   for (i=0; i<sweepackdelay.n; i++)
+      if (sweepackdelay.v[i] < 0.0) {
+         printf("ACK delay must be >= 0.0\n");
+         exit(1);
+         }
+   for (i=0; i<sweepdupthresh.n; i++)
+      if (sweepdupthresh.v[i] < 0) {
+         printf("duplicate ACK threshold must be >= 0\n");
+         exit(1);
+         }
+   if (nrepeat < 1)
+      nrepeat = 1;
+   /* more than one run to do: that's a sweep, even without -o */
+   if (sweepout==NULL &&
+       sweeploss.n*sweepcorrupt.n*sweepavgtime.n*sweeptimeout.n*sweepwindow.n*sweepmsgsize.n*
+       sweepbandwidth.n*sweepsendq.n*sweepackdelay.n*sweepdupthresh.n*nrepeat > 1)
+      sweepout = "-";
+}
+
+/* messages delivered to layer 5 per 1000 time units */
+float goodput(int ndelivered, double time)
+{
+   return(time>0.0 ? 1000.0*ndelivered/time : 0.0);
+}
+
+/* the fraction of the time the link out of AorB was sending, leaving out
+   what was still queued when the run ended */
+float linkutil(struct sim *sim, int AorB)
+{
+   struct link *lk = &sim->link[AorB];
+   int64_t busy = lk->busytime;
+
+   if (lk->busyuntil > sim->now)
+      busy -= lk->busyuntil - sim->now;
+   return(sim->now>0 ? (double)busy/sim->now : 0.0);
+}
+
+/* retransmissions as a fraction of everything sent into layer 3 */
+float retxratio(int nretransmit, int ntolayer3)
+{
+   return(ntolayer3>0 ? (float)nretransmit/ntolayer3 : 0.0);
+}
+
+/* one line of JSON with the run's parameters and results, for scripts.
+   latencies are in time units, from a message's arrival from layer 5 to
+   its delivery to layer 5 at the other side */
+void printsummary(struct sim *sim)
+{
+   struct hdrhist *h = &sim->latency;
+
+   printf("{\"seed\": %u, \"messages\": %d, \"loss\": %f, \"corrupt\": %f, "
+          "\"avgtime\": %f, \"timeout\": %f, \"window\": %d, \"aimd\": %d, "
+          "\"time\": %f, \"nsim\": %d, \"ntolayer3\": %d, \"nlost\": %d, "
+          "\"ncorrupt\": %d, \"ndelivered\": %d, \"nmsgdrop\": %d, \"nmsglost\": %d, "
+          "\"goodput\": %f, "
+          "\"avgwindow\": %f, \"adaptive\": %d, \"rto\": [%f, %f], "
+          "\"srtt\": [%f, %f], \"rttvar\": [%f, %f], \"nretransmit\": %d, \"nspurious\": %d, "
+          "\"retxratio\": %f, "
+          "\"latency\": {\"n\": %ld, \"min\": %f, \"mean\": %f, \"p50\": %f, "
+          "\"p99\": %f, \"p999\": %f, \"max\": %f}, "
+          "\"checksum\": \"%s\", \"msgsize\": %d, \"msgmin\": %d, \"mss\": %d, "
+          "\"bandwidth\": [%f, %f], \"propdelay\": [%f, %f], "
+          "\"queue\": [%d, %d], \"qdisc\": \"%s\", \"nqdrop\": %d, "
+          "\"util\": [%f, %f], "
+          "\"sendq\": %d, \"sqpolicy\": \"%s\", \"sqdepth\": %f, \"sqmax\": %d, "
+          "\"blocked\": %f, "
+          "\"duplex\": %d, \"ackdelay\": %f, \"nackpkts\": %d, \"npiggyback\": %d, "
+          "\"dupthresh\": %d, \"nfastretx\": %d, \"ntimeoutsaved\": %d, "
+          "\"event_slabs\": %ld, \"pkt_slabs\": %ld}\n",
+          sim->seed, sim->nsimmax, sim->lossprob, sim->corruptprob, sim->lambda,
+          sim->timeoutlen, sim->winsize, sim->aimd, sim->time, sim->nsim,
+          sim->ntolayer3, sim->nlost, sim->ncorrupt, sim->ndelivered, sim->nmsgdrop,
+          sim->nmsglost, goodput(sim->ndelivered, sim->time),
+          sim->time>0.0 ? sim->windowtime/sim->time : 0.0, sim->adaptive,
+          sim->rtt[A].rto, sim->rtt[B].rto, sim->rtt[A].srtt, sim->rtt[B].srtt,
+          sim->rtt[A].rttvar, sim->rtt[B].rttvar, sim->nretransmit, sim->nspurious,
+          retxratio(sim->nretransmit, sim->ntolayer3),
+          h->n, TICKTIME(h->min), h->n>0 ? h->sum/h->n/TICKS_PER_UNIT : 0.0,
+          hdrpercentile(h, 50.0), hdrpercentile(h, 99.0), hdrpercentile(h, 99.9),
+          TICKTIME(h->max),
+          cksumnames[sim->cksum], sim->msgsize, sim->msgmin, sim->mss,
+          sim->link[A].bandwidth, sim->link[B].bandwidth,
+          sim->link[A].propdelay, sim->link[B].propdelay,
+          sim->link[A].qlimit, sim->link[B].qlimit, qdiscnames[sim->qdisc],
+          sim->nqdrop, linkutil(sim, A), linkutil(sim, B),
+          sim->sendqlen, sqpolicynames[sim->sqpolicy], sendqdepth(sim, A),
+          sim->sendq[A].maxdepth, sendqblocked(sim, A),
+          sim->duplex, sim->ackdelay, sim->nackpkts, sim->npiggyback,
+          sim->dupthresh, sim->nfastretx, sim->ntimeoutsaved,
+          sim->eventpool.nslabs, sim->pktpool.nslabs);
+}
+
+/* the sweep's runs are handed out to the worker threads one at a time */
+struct sweepjob {
+   struct runresult *res;
+   int nruns;
+   int next;                   /* next run nobody has picked up */
+   pthread_mutex_t lock;
+};
+
+void *sweepworker(void *arg)
+{
+   struct sweepjob *job = (struct sweepjob *)arg;
+   struct runresult *res;
+   struct sim *sim;
+
+   while (1) {
+      pthread_mutex_lock(&job->lock);
+      res = job->next<job->nruns ? &job->res[job->next++] : NULL;
+      pthread_mutex_unlock(&job->lock);
+      if (res==NULL)
+         return(NULL);
+
+      sim = newsim(&res->p);
+      A_init(sim);
+      B_init(sim);
+      simulate(sim);
+      res->p.timeoutlen = sim->timeoutlen;  /* the protocol may pick its own */
+      res->p.winsize = sim->winsize;
+      res->time = sim->time;
+      res->nsim = sim->nsim;
+      res->ntolayer3 = sim->ntolayer3;
+      res->nlost = sim->nlost;
+      res->ncorrupt = sim->ncorrupt;
+      res->ndelivered = sim->ndelivered;
+      res->nmsgdrop = sim->nmsgdrop;
+      res->nackpkts = sim->nackpkts;
+      res->npiggyback = sim->npiggyback;
+      res->nfastretx = sim->nfastretx;
+      res->ntimeoutsaved = sim->ntimeoutsaved;
+      res->nretransmit = sim->nretransmit;
+      res->nspurious = sim->nspurious;
+      res->nqdrop = sim->nqdrop;
+      res->util = linkutil(sim, A);
+      res->p50 = hdrpercentile(&sim->latency, 50.0);
+      res->p99 = hdrpercentile(&sim->latency, 99.0);
+      res->p999 = hdrpercentile(&sim->latency, 99.9);
+      res->sqdepth = sendqdepth(sim, A);
+      res->blocked = sendqblocked(sim, A);
+      res->avgwindow = sim->time>0.0 ? sim->windowtime/sim->time : 0.0;
+      freesim(sim);
+      }
+}
+
+void writeresults(struct runresult *res, int nruns)
+{
+   FILE *fp;
+   int json, i;
+
+   json = strlen(sweepout)>5 && strcmp(sweepout+strlen(sweepout)-5, ".json")==0;
+   if (strcmp(sweepout, "-")==0)
+      fp = stdout;
+   else if ((fp = fopen(sweepout, "w"))==NULL) {
+      printf("cannot write sweep results to %s\n", sweepout);
+      exit(1);
+      }
+   if (json)
+      fprintf(fp, "[\n");
+   else
+      fprintf(fp, "loss,corrupt,avgtime,timeout,window,msgsize,bandwidth,sendq,ackdelay,dupthresh,seed,time,nsim,ntolayer3,"
+              "nlost,ncorrupt,ndelivered,nmsgdrop,goodput,avgwindow,nretransmit,nspurious,nqdrop,util,"
+              "retxratio,p50,p99,p999,sqdepth,blocked,nackpkts,npiggyback,nfastretx,ntimeoutsaved\n");
+   for (i=0; i<nruns; i++) {
+      if (json)
+         fprintf(fp, "  {\"loss\": %f, \"corrupt\": %f, \"avgtime\": %f, "
+                 "\"timeout\": %f, \"window\": %d, \"msgsize\": %d, "
+                 "\"bandwidth\": %f, \"sendq\": %d, \"ackdelay\": %f, \"dupthresh\": %d, "
+                 "\"seed\": %u, "
+                 "\"time\": %f, \"nsim\": %d, \"ntolayer3\": %d, \"nlost\": %d, "
+                 "\"ncorrupt\": %d, \"ndelivered\": %d, \"nmsgdrop\": %d, "
+                 "\"goodput\": %f, "
+                 "\"avgwindow\": %f, \"nretransmit\": %d, \"nspurious\": %d, "
+                 "\"nqdrop\": %d, \"util\": %f, \"retxratio\": %f, "
+                 "\"p50\": %f, \"p99\": %f, \"p999\": %f, \"sqdepth\": %f, "
+                 "\"blocked\": %f, \"nackpkts\": %d, \"npiggyback\": %d, "
+                 "\"nfastretx\": %d, \"ntimeoutsaved\": %d}%s\n",
+                 res[i].p.lossprob, res[i].p.corruptprob, res[i].p.lambda,
+                 res[i].p.timeoutlen, res[i].p.winsize, res[i].p.msgsize,
+                 res[i].p.bandwidth[A], res[i].p.sendqlen, res[i].p.ackdelay, res[i].p.dupthresh,
+                 res[i].p.seed,
+                 res[i].time,
+                 res[i].nsim, res[i].ntolayer3, res[i].nlost, res[i].ncorrupt,
+                 res[i].ndelivered, res[i].nmsgdrop, goodput(res[i].ndelivered, res[i].time),
+                 res[i].avgwindow, res[i].nretransmit, res[i].nspurious,
+                 res[i].nqdrop, res[i].util,
+                 retxratio(res[i].nretransmit, res[i].ntolayer3),
+                 res[i].p50, res[i].p99, res[i].p999, res[i].sqdepth, res[i].blocked,
+                 res[i].nackpkts, res[i].npiggyback, res[i].nfastretx, res[i].ntimeoutsaved,
+                 i+1<nruns ? "," : "");
+      else
+         fprintf(fp, "%f,%f,%f,%f,%d,%d,%f,%d,%f,%d,%u,%f,%d,%d,%d,%d,%d,%d,%f,%f,%d,%d,%d,%f,%f,%f,%f,"
+                 "%f,%f,%f,%d,%d,%d,%d\n",
+                 res[i].p.lossprob, res[i].p.corruptprob, res[i].p.lambda,
+                 res[i].p.timeoutlen, res[i].p.winsize, res[i].p.msgsize,
+                 res[i].p.bandwidth[A], res[i].p.sendqlen, res[i].p.ackdelay, res[i].p.dupthresh,
+                 res[i].p.seed,
+                 res[i].time,
+                 res[i].nsim, res[i].ntolayer3, res[i].nlost, res[i].ncorrupt,
+                 res[i].ndelivered, res[i].nmsgdrop, goodput(res[i].ndelivered, res[i].time),
+                 res[i].avgwindow, res[i].nretransmit, res[i].nspurious,
+                 res[i].nqdrop, res[i].util,
+                 retxratio(res[i].nretransmit, res[i].ntolayer3),
+                 res[i].p50, res[i].p99, res[i].p999, res[i].sqdepth, res[i].blocked,
+                 res[i].nackpkts, res[i].npiggyback, res[i].nfastretx, res[i].ntimeoutsaved);
+      }
+   if (json)
+      fprintf(fp, "]\n");
+   if (fp!=stdout)
+      fclose(fp);
+}
+
+void runsweep()
+{
+   struct sweepjob job;
+   pthread_t *threads;
+   int i, k;
+
+   job.nruns = sweeploss.n*sweepcorrupt.n*sweepavgtime.n*sweeptimeout.n*sweepwindow.n*
+               sweepmsgsize.n*sweepbandwidth.n*sweepsendq.n*sweepackdelay.n*sweepdupthresh.n*
+               nrepeat;
+   job.res = (struct runresult *)calloc(job.nruns, sizeof(struct runresult));
+   job.next = 0;
+   pthread_mutex_init(&job.lock, NULL);
+   for (i=0; i<job.nruns; i++) {     /* run i's point on the grid */
+      job.res[i].p = params;
+      job.res[i].p.trace = -1;       /* the runs would all talk at once */
+      job.res[i].p.evlogfile = NULL;
+      job.res[i].p.replayfile = NULL;
+      k = i/nrepeat;
+      job.res[i].p.seed = params.seed + i%nrepeat;
+      job.res[i].p.dupthresh = (int)sweepdupthresh.v[k%sweepdupthresh.n];
+      k /= sweepdupthresh.n;
+      job.res[i].p.ackdelay = sweepackdelay.v[k%sweepackdelay.n];
+      k /= sweepackdelay.n;
+      job.res[i].p.sendqlen = (int)sweepsendq.v[k%sweepsendq.n];
+      k /= sweepsendq.n;
+      job.res[i].p.bandwidth[A] = sweepbandwidth.v[k%sweepbandwidth.n];
+      job.res[i].p.bandwidth[B] = sweepbandwidthba[k%sweepbandwidth.n];
+      k /= sweepbandwidth.n;
+      job.res[i].p.msgsize = (int)sweepmsgsize.v[k%sweepmsgsize.n];
+      k /= sweepmsgsize.n;
+      job.res[i].p.winsize = (int)sweepwindow.v[k%sweepwindow.n];
+      k /= sweepwindow.n;
+      job.res[i].p.timeoutlen = sweeptimeout.v[k%sweeptimeout.n];
+      k /= sweeptimeout.n;
+      job.res[i].p.lambda = sweepavgtime.v[k%sweepavgtime.n];
+      k /= sweepavgtime.n;
+      job.res[i].p.corruptprob = sweepcorrupt.v[k%sweepcorrupt.n];
+      k /= sweepcorrupt.n;
+      job.res[i].p.lossprob = sweeploss.v[k];
+      }
+
+   if (njobs<=0)
+      njobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (njobs<=0)
+      njobs = 1;
+   if (njobs>job.nruns)
+      njobs = job.nruns;
+   threads = (pthread_t *)calloc(njobs, sizeof(pthread_t));
+   for (i=0; i<njobs; i++)
+      if (pthread_create(&threads[i], NULL, sweepworker, &job)!=0) {
+         printf("sweep: cannot start a worker thread\n");
+         exit(1);
+         }
+   for (i=0; i<njobs; i++)
+      pthread_join(threads[i], NULL);
+
+   writeresults(job.res, job.nruns);
+   pthread_mutex_destroy(&job.lock);
+   free(job.res);
+   free(threads);
+}
+
+void init(int argc, char *argv[])   /* initialize the simulator */
+{
+  char *envseed;
+  
+  if ((envseed = getenv("SIM_SEED"))!=NULL)
+     params.seed = (unsigned int)strtoul(envseed, NULL, 10);
+
+  if (argc > 1) {
+   batch = 1;
+   getparams(argc, argv);
+   }
+  else {
+   printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
+   printf("Enter the number of messages to simulate: ");
+   scanf("%d",&params.nsimmax);
+   printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+   scanf("%f",&params.lossprob);
+   printf("Enter packet corruption probability [0.0 for no corruption]:");
+   scanf("%f",&params.corruptprob);
+   printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
+   scanf("%f",&params.lambda);
+   printf("Enter TRACE:");
+   scanf("%d",&params.trace);
+   }
+}
+
+/* set up a simulation ready to run: seed its random number generator,
+   clear the counters and schedule the first message */
+struct sim *newsim(struct simparams *p)
+{
+  struct sim *sim;
+  int i;
+
+   sim = (struct sim *)calloc(1, sizeof(struct sim));
+   if (sim==NULL) {
+      printf("INTERNAL PANIC: out of memory for simulation\n");
+      exit(1);
+      }
+   sim->nsimmax = p->nsimmax;
+   sim->lossprob = p->lossprob;
+   sim->corruptprob = p->corruptprob;
+   sim->lambda = p->lambda;
+   sim->timeoutlen = p->timeoutlen;
+   sim->winsize = p->winsize;
+   sim->aimd = p->aimd;
+   sim->adaptive = p->adaptive;
+   sim->cksum = p->cksum;
+   sim->msgsize = p->msgsize;
+   sim->msgmin = p->msgmin;
+   sim->mss = p->mss;
+   for (i=0; i<2; i++) {
+      sim->link[i].bandwidth = p->bandwidth[i];
+      sim->link[i].propdelay = p->propdelay[i];
+      sim->link[i].qlimit = p->qlimit[i];
+      }
+   sim->qdisc = p->qdisc;
+   sim->duplex = p->duplex;
+   sim->ackdelay = p->ackdelay;
+   sim->dupthresh = p->dupthresh;
+   sim->sendqlen = p->sendqlen;
+   sim->sqpolicy = p->sqpolicy;
+   sim->trace = p->trace;
+   sim->seed = p->seed;
+   traceopen(sim, p->tracefile);
+   evlogopen(sim, p->evlogfile, p->replayfile);  /* may reset the parameters */
+   sim->eventpool.objsize = sizeof(struct event);
+   sim->pktpool.objsize = sizeof(struct pkt) + sim->mss;  /* payload follows */
+   sim->msgpool.objsize = sim->msgsize;
+
+   /* the random number streams need no setup: calloc starts every one */
+   /* at block 0, and the seed is their key */
+
+   sim->now = 0;                /* initialize time to 0 */
+   sim->time = 0.0;
+   generate_next_arrival(sim, A);  /* initialize event list */
+   if (sim->duplex)
+      generate_next_arrival(sim, B);
+   return(sim);
+}
+
+/* free everything the simulation and its protocol allocated */
+void freesim(struct sim *sim)
+{
+   poolrelease(&sim->eventpool);
+   poolrelease(&sim->pktpool);
+   poolrelease(&sim->msgpool);
+   free(sim->evheap);
+   free(sim->sent[A].t);
+   free(sim->sent[B].t);
+   free(sim->sendq[A].q);
+   free(sim->sendq[B].q);
+   free(sim->Astate);
+   free(sim->Bstate);
+   traceclose(sim);
+   evlogclose(sim);
+   free(sim);
+}
+
+/****************************************************************************/
+/* jimsrand(): return a float in range [0,1).  The routine below is used to */
+/* isolate all random number generation in one location.                   */
+/*                                                                          */
+/* numbers come from philox4x32-10 (Salmon et al., "Parallel random numbers: */
+/* as easy as 1, 2, 3"), a counter based generator: block n of a stream is  */
+/* just a keyed hash of n, here keyed on the seed and the stream number.    */
+/* that makes every simulation and every stream within it independent, the */
+/* same on every platform, and cheap - one hash per four numbers.           */
+/****************************************************************************/
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+void philox4x32(uint32_t ctr[4], uint32_t key[2], uint32_t out[4])
+{
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  uint64_t p0, p1;
+  int round;
+
+  for (round=0; round<10; round++) {
+     p0 = (uint64_t)PHILOX_M0 * c0;
+     p1 = (uint64_t)PHILOX_M1 * c2;
+     c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+     c1 = (uint32_t)p1;
+     c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+     c3 = (uint32_t)p0;
+     k0 += PHILOX_W0;
+     k1 += PHILOX_W1;
+     }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+float jimsrand(struct sim *sim, int stream) 
+{
+  struct randstream *rs = &sim->rand[stream];
+  uint32_t ctr[4], key[2], bits;
+
+  if (rs->left==0) {
+     ctr[0] = (uint32_t)rs->ctr;
+     ctr[1] = (uint32_t)(rs->ctr >> 32);
+     ctr[2] = (uint32_t)stream;
+     ctr[3] = 0;
+     key[0] = sim->seed;
+     key[1] = 0;
+     philox4x32(ctr, key, rs->out);
+     rs->ctr++;
+     rs->left = 4;
+     }
+  /* top 24 bits, so the float is exact and strictly below 1 */
+  bits = rs->out[--rs->left] >> 8;
+  if (sim->evlog!=NULL)
+     evlogdraw(sim, stream, bits);
+  return(bits * (1.0f/16777216.0f));
+}  
+
+/************************** OBJECT POOLS ************************/
+/* events and packets are allocated and freed once per packet sent, so   */
+/* they come out of fixed-size pools instead of malloc/free. freed       */
+/* objects go on a freelist and slabs of POOL_SLAB_OBJS objects are only */
+/* malloc'd when the freelist runs dry, so a long run reaches a steady   */
+/* state with no malloc traffic at all. large objects such as big        */
+/* messages come fewer to a slab, keeping slabs to about POOL_SLAB_BYTES.*/
+/****************************************************************/
+
+#define POOL_SLAB_OBJS 256
+#define POOL_SLAB_BYTES (1<<20)
+
+void *poolalloc(struct pool *pl)
+{
+   char *slab;
+   void *obj;
+   int i, n;
+
+   if (pl->freelist==NULL) {
+      if (pl->objsize % sizeof(void *))   /* room and alignment for the link */
+         pl->objsize += sizeof(void *) - pl->objsize % sizeof(void *);
+      n = POOL_SLAB_OBJS;
+      if (n*pl->objsize > POOL_SLAB_BYTES)
+         n = pl->objsize < POOL_SLAB_BYTES ? POOL_SLAB_BYTES/pl->objsize : 1;
+      /* new slab: a link to the previous slab, then the objects */
+      slab = (char *)malloc(sizeof(void *) + n*pl->objsize);
+      if (slab==NULL) {
+         printf("INTERNAL PANIC: out of memory for object pool\n");
+         exit(1);
+         }
+      *(void **)slab = pl->slabs;
+      pl->slabs = slab;
+      pl->nslabs++;
+      for (i=n-1; i>=0; i--) {
+         obj = slab + sizeof(void *) + i*pl->objsize;
+         *(void **)obj = pl->freelist;
+         pl->freelist = obj;
+         }
+      }
+   obj = pl->freelist;
+   pl->freelist = *(void **)obj;
+   pl->nalloc++;
+   if (++pl->inuse > pl->maxinuse)
+      pl->maxinuse = pl->inuse;
+   return(obj);
+}
+
+void poolfree(struct pool *pl, void *obj)
+{
+   if (obj==NULL)
+      return;
+   *(void **)obj = pl->freelist;
+   pl->freelist = obj;
+   pl->nfree++;
+   pl->inuse--;
+}
+
+/* give every slab back to malloc, whether its objects were freed or not */
+void poolrelease(struct pool *pl)
+{
+   void *slab;
+
+   while ((slab = pl->slabs)!=NULL) {
+      pl->slabs = *(void **)slab;
+      free(slab);
+      }
+   pl->freelist = NULL;
+}
+
+void printpoolstats(char *name, struct pool *pl)
+{
+   printf(" %s pool: %ld allocs, %ld frees, peak %ld in use, %ld slab mallocs\n",
+          name, pl->nalloc, pl->nfree, pl->maxinuse, pl->nslabs);
+}
+
+struct event *allocevent(struct sim *sim)
+{
+   return((struct event *)poolalloc(&sim->eventpool));
+}
+
+void freeevent(struct sim *sim, struct event *p)
+{
+   if (p!=NULL)
+      p->evseq = (unsigned long)-1;  /* no timer handle matches it now */
+   poolfree(&sim->eventpool, p);
+}
+
+/* a packet with room for sim->mss bytes of payload after it, which its
+   payload points at. the caller holds the one reference to it */
+struct pkt *allocpkt(struct sim *sim)
+{
+   struct pkt *packet = (struct pkt *)poolalloc(&sim->pktpool);
+
+   packet->len = 0;
+   packet->msglen = 0;
+   packet->payload = (char *)(packet+1);
+   packet->refs = 1;
+   return(packet);
+}
+
+/* another reference to packet, dropped with freepkt() */
+struct pkt *holdpkt(struct pkt *packet)
+{
+   packet->refs++;
+   return(packet);
+}
+
+/* drops a reference, freeing packet with the last one. safe to call on
+   NULL, like free() */
+void freepkt(struct sim *sim, struct pkt *packet)
+{
+   if (packet!=NULL && --packet->refs==0)
+      poolfree(&sim->pktpool, packet);
+}
+
+/* packet itself if the caller holds the only reference, else a copy of
+   it that does, so the caller can change it without the others seeing */
+struct pkt *ownpkt(struct sim *sim, struct pkt *packet)
+{
+   struct pkt *copy;
+
+   if (packet->refs==1)
+      return(packet);
+   copy = allocpkt(sim);
+   copy->seqnum = packet->seqnum;
+   copy->acknum = packet->acknum;
+   copy->checksum = packet->checksum;
+   copy->len = packet->len;
+   copy->msglen = packet->msglen;
+   memcpy(copy->payload, packet->payload, packet->len);
+   freepkt(sim, packet);
+   return(copy);
+}
+
+/* a buffer for one message, sim->msgsize bytes */
+char *allocmsg(struct sim *sim)
+{
+   return((char *)poolalloc(&sim->msgpool));
+}
+
+/* safe to call on NULL, like free() */
+void freemsg(struct sim *sim, char *data)
+{
+   poolfree(&sim->msgpool, data);
+}
+
+/* the protocol won't send a message A_output() or B_output() gave it */
+void dropmsg(struct sim *sim, char *data)
+{
+   sim->nmsgdrop++;
+   freemsg(sim, data);
+}
+
+/* AorB gave up on a message it was putting back together, one the other
+   side's protocol had taken. it is counted, and its stamp goes so the
+   next message delivered isn't timed from it */
+void lostmsg(struct sim *sim, int AorB)
+{
+   int64_t t;
+
+   sim->nmsglost++;
+   stamppop(&sim->sent[1-AorB], &t);
+}
+
+/********************* EVENT HANDLINE ROUTINES *******/
+/*  The next set of routines handle the event list   */
+/*****************************************************/
+
+/* bytes in the next message from layer 5: msgsize, or with msgmin set
+   any of msgmin..msgsize with equal chance */
+int msglength(struct sim *sim)
+{
+   int n;
+
+   if (sim->msgmin<=0 || sim->msgmin>=sim->msgsize)
+      return(sim->msgsize);
+   n = sim->msgsize - sim->msgmin + 1;
+   return(sim->msgmin + (int)(n*(double)jimsrand(sim, RAND_MSGLEN)) % n);
+}
+ 
+/* messages come down to each sending side on its own: with duplex on, A
+   and B each get one every 2*lambda on average, so together they still
+   get one every lambda. when layer 5 is blocked at one side (SQ_BLOCK)
+   only that side's arrivals wait */
+void generate_next_arrival(struct sim *sim, int AorB)
+{
+   double x;
+   struct event *evptr;
+    // char *malloc();
+
+   if (sim->replay)             /* arrivals are in the log */
+      return;
+   TRACEREC(sim, 3, TR_ARRIVAL, AorB, 0, 0, 0, 0.0, NULL, 0);
+ 
+   x = sim->lambda*jimsrand(sim, RAND_ARRIVAL)*2;  /* x is uniform on [0,2*lambda] */
+                                     /* having mean of lambda        */
+   if (sim->duplex)
+      x *= 2;
+   evptr = allocevent(sim);
+   evptr->evtime =  sim->now + TICKS(x);
+   evptr->evtype =  FROM_LAYER5;
+   evptr->eventity = AorB;
+   insertevent(sim, evptr);
+} 
+
+
+/* list scheduler: keep evlist sorted on evtime, a new event goes in front
+   of any already there with the same time */
+void listinsert(struct sim *sim, struct event *p)
+{
+   struct event *q,*qold;
+
+   q = sim->evlist; /* q points to header of list in which p struct inserted */
+   if (q==NULL) {   /* list is empty */
+        sim->evlist=p;
+        p->next=NULL;
+        p->prev=NULL;
+        }
+     else {
+        for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
+              qold=q; 
+        if (q==NULL) {   /* end of list */
+             qold->next = p;
+             p->prev = qold;
+             p->next = NULL;
+             }
+           else if (q==sim->evlist) { /* front of list */
+             p->next=sim->evlist;
+             p->prev=NULL;
+             p->next->prev=p;
+             sim->evlist = p;
+             }
+           else {     /* middle of list */
+             p->next=q;
+             p->prev=q->prev;
+             q->prev->next=p;
+             q->prev=p;
+             }
+         }
+}
+
+void listremove(struct sim *sim, struct event *q)
+{
+   if (q->next==NULL && q->prev==NULL)
+      sim->evlist=NULL;    /* remove first and only event on list */
+   else if (q->next==NULL) /* end of list - there is one in front */
+      q->prev->next = NULL;
+   else if (q==sim->evlist) { /* front of list - there must be event after */
+      q->next->prev=NULL;
+      sim->evlist = q->next;
+      }
+   else {     /* middle of list */
+      q->next->prev = q->prev;
+      q->prev->next =  q->next;
+      }
+}
+
+/* heap scheduler: evheap[0] is the next event, ties on evtime go to the
+   most recently inserted event so the order matches the list scheduler */
+int evbefore(struct event *p, struct event *q)
+{
+   if (p->evtime != q->evtime)
+      return(p->evtime < q->evtime);
+   return(p->evseq > q->evseq);
+}
+
+void heapset(struct sim *sim, int i, struct event *p)
+{
+   sim->evheap[i] = p;
+   p->heapidx = i;
+}
+
+void heapsiftup(struct sim *sim, int i)
+{
+   struct event *p = sim->evheap[i];
+   int parent;
+
+   while (i>0) {
+      parent = (i-1)/2;
+      if (!evbefore(p, sim->evheap[parent]))
+         break;
+      heapset(sim, i, sim->evheap[parent]);
+      i = parent;
+      }
+   heapset(sim, i, p);
+}
+
+void heapsiftdown(struct sim *sim, int i)
+{
+   struct event *p = sim->evheap[i];
+   int child;
+
+   while ((child = 2*i+1) < sim->evheapsize) {
+      if (child+1<sim->evheapsize && evbefore(sim->evheap[child+1], sim->evheap[child]))
+         child++;
+      if (!evbefore(sim->evheap[child], p))
+         break;
+      heapset(sim, i, sim->evheap[child]);
+      i = child;
+      }
+   heapset(sim, i, p);
+}
+
+void heapinsert(struct sim *sim, struct event *p)
+{
+   if (sim->evheapsize==sim->evheapcap) {
+      sim->evheapcap = sim->evheapcap ? 2*sim->evheapcap : 64;
+      sim->evheap = (struct event **)realloc(sim->evheap,
+                                    sim->evheapcap*sizeof(struct event *));
+      if (sim->evheap==NULL) {
+         printf("INTERNAL PANIC: out of memory for event heap\n");
+         exit(1);
+         }
+      }
+   heapset(sim, sim->evheapsize++, p);
+   heapsiftup(sim, p->heapidx);
+}
+
+void heapremove(struct sim *sim, struct event *p)
+{
+   int i = p->heapidx;
+   struct event *last = sim->evheap[--sim->evheapsize];
+
+   if (last!=p) {
+      heapset(sim, i, last);
+      if (i>0 && evbefore(last, sim->evheap[(i-1)/2]))
+         heapsiftup(sim, i);
+      else
+         heapsiftdown(sim, i);
+      }
+}
+
+/* timer wheel: the due bucket holds the timers of ticks up to now, in the
+   order popevent() hands them out. the wheel only turns as far as the next
+   queued event, so the due bucket never holds more than one tick's worth */
+unsigned long wheeltick(int64_t t)
+{
+   return((unsigned long)(t/WHEEL_TICK));
+}
+
+int lowbit(uint64_t x)
+{
+#ifdef __GNUC__
+   return(__builtin_ctzll(x));
+#else
+   int i;
+
+   for (i=0; !(x & 1); i++)
+      x >>= 1;
+   return(i);
+#endif
+}
+
+void wheelplace(struct sim *sim, struct event *p)
+{
+   struct wheel *w = &sim->wheel;
+   unsigned long t = wheeltick(p->evtime);
+   struct event *q, *qold;
+   int b, level, slot;
+
+   if (t<=w->now) {   /* due: keep the bucket sorted */
+      for (qold = NULL, q = w->bucket[WHEEL_DUE]; q!=NULL && evbefore(q, p); q = q->next)
+         qold = q;
+      p->wheelslot = WHEEL_DUE;
+      p->prev = qold;
+      p->next = q;
+      if (q!=NULL)
+         q->prev = p;
+      if (qold!=NULL)
+         qold->next = p;
+       else
+         w->bucket[WHEEL_DUE] = p;
+      return;
+      }
+   b = WHEEL_OVERFLOW;
+   for (level=0; level<WHEEL_LEVELS; level++)
+      if (t>>((level+1)*WHEEL_BITS) == w->now>>((level+1)*WHEEL_BITS)) {
+         slot = (t>>(level*WHEEL_BITS)) & (WHEEL_SLOTS-1);
+         b = 1 + level*WHEEL_SLOTS + slot;
+         w->used[level] |= (uint64_t)1 << slot;
+         break;
+         }
+   p->wheelslot = b;
+   p->prev = NULL;
+   p->next = w->bucket[b];
+   if (p->next!=NULL)
+      p->next->prev = p;
+   w->bucket[b] = p;
+}
+
+void wheelunlink(struct sim *sim, struct event *p)
+{
+   struct wheel *w = &sim->wheel;
+   int b = p->wheelslot;
+
+   if (p->prev!=NULL)
+      p->prev->next = p->next;
+    else
+      w->bucket[b] = p->next;
+   if (p->next!=NULL)
+      p->next->prev = p->prev;
+   if (w->bucket[b]==NULL && b!=WHEEL_DUE && b!=WHEEL_OVERFLOW)
+      w->used[(b-1)/WHEEL_SLOTS] &= ~((uint64_t)1 << (b-1)%WHEEL_SLOTS);
+}
+
+/* turn the wheel to the next tick that has timers, unless that is later
+   than tick limit. the timers of a higher level bucket are spread over
+   the levels below. returns 0 if the wheel didn't move */
+int wheelturn(struct sim *sim, unsigned long limit)
+{
+   struct wheel *w = &sim->wheel;
+   struct event *p, *q;
+   unsigned long start;
+   uint64_t later;
+   int level, digit, slot, b;
+
+   b = -1;
+   for (level=0; level<WHEEL_LEVELS && b<0; level++) {
+      digit = (w->now>>(level*WHEEL_BITS)) & (WHEEL_SLOTS-1);
+      later = digit+1<WHEEL_SLOTS ? w->used[level] & (~(uint64_t)0 << (digit+1)) : 0;
+      if (later==0)
+         continue;
+      slot = lowbit(later);
+      start = w->now>>((level+1)*WHEEL_BITS)<<((level+1)*WHEEL_BITS)
+              | (unsigned long)slot<<(level*WHEEL_BITS);
+      b = 1 + level*WHEEL_SLOTS + slot;
+      w->used[level] &= ~((uint64_t)1 << slot);
+      }
+   if (b<0) {   /* every level is empty, go to the earliest overflow timer */
+      if (w->bucket[WHEEL_OVERFLOW]==NULL)
+         return(0);
+      start = (unsigned long)-1;
+      for (q = w->bucket[WHEEL_OVERFLOW]; q!=NULL; q = q->next)
+         if (wheeltick(q->evtime)<start)
+            start = wheeltick(q->evtime);
+      b = WHEEL_OVERFLOW;
+      }
+   if (start>limit) {
+      if (b!=WHEEL_OVERFLOW)
+         w->used[(b-1)/WHEEL_SLOTS] |= (uint64_t)1 << (b-1)%WHEEL_SLOTS;
+      return(0);
+      }
+   w->now = start;
+   p = w->bucket[b];
+   w->bucket[b] = NULL;
+   while (p!=NULL) {
+      q = p->next;
+      wheelplace(sim, p);
+      p = q;
+      }
+   return(1);
+}
+
+/* the earliest timer, if it is due no later than tick limit */
+struct event *wheelpeek(struct sim *sim, unsigned long limit)
+{
+   while (sim->wheel.bucket[WHEEL_DUE]==NULL)
+      if (!wheelturn(sim, limit))
+         return(NULL);
+   return(sim->wheel.bucket[WHEEL_DUE]);
+}
+
+/* first timer in bucket b or later, in no particular order */
+struct event *wheelfirst(struct sim *sim, int b)
+{
+   for (; b<WHEEL_NBUCKETS; b++)
+      if (sim->wheel.bucket[b]!=NULL)
+         return(sim->wheel.bucket[b]);
+   return(NULL);
+}
+
+void insertevent(struct sim *sim, struct event *p)
+{
+   TRACEREC(sim, 3, TR_INSERT, p->eventity, 0, 0, 0, p->evtime, NULL, 0);
+   p->evseq = sim->nevinserted++;
+   if (WHEELED(p))
+      wheelplace(sim, p);
+#if SCHEDULER == LIST_SCHEDULER
+    else
+      listinsert(sim, p);
+#else
+    else
+      heapinsert(sim, p);
+#endif
+}
+
+/* remove and return the next event to simulate, NULL if there is none */
+struct event *popevent(struct sim *sim)
+{
+   struct event *p, *t;
+
+#if SCHEDULER == LIST_SCHEDULER
+   p = sim->evlist;
+#else
+   p = sim->evheapsize>0 ? sim->evheap[0] : NULL;
+#endif
+   if (TIMERWHEEL) {
+      t = wheelpeek(sim, p!=NULL ? wheeltick(p->evtime) : (unsigned long)-1);
+      if (t!=NULL && (p==NULL || evbefore(t, p))) {
+         wheelunlink(sim, t);
+         return(t);
+         }
+      }
+   if (p!=NULL)
+#if SCHEDULER == LIST_SCHEDULER
+      listremove(sim, p);
+#else
+      heapremove(sim, p);
+#endif
+   return(p);
+}
+
+/* remove an event that is still pending, wherever it is in the schedule */
+void removeevent(struct sim *sim, struct event *p)
+{
+   if (WHEELED(p))
+      wheelunlink(sim, p);
+#if SCHEDULER == LIST_SCHEDULER
+    else
+      listremove(sim, p);
+#else
+    else
+      heapremove(sim, p);
+#endif
+}
+
+/* walk every pending event (not in time order for the heap or the wheel):
+   for (q=firstevent(sim); q!=NULL; q=nextevent(sim, q)) */
+struct event *firstevent(struct sim *sim)
+{
+   struct event *q;
+
+#if SCHEDULER == LIST_SCHEDULER
+   q = sim->evlist;
+#else
+   q = sim->evheapsize>0 ? sim->evheap[0] : NULL;
+#endif
+   return(q!=NULL || !TIMERWHEEL ? q : wheelfirst(sim, 0));
+}
+
+struct event *nextevent(struct sim *sim, struct event *q)
+{
+   if (WHEELED(q))
+      return(q->next!=NULL ? q->next : wheelfirst(sim, q->wheelslot+1));
+#if SCHEDULER == LIST_SCHEDULER
+   q = q->next;
+#else
+   q = q->heapidx+1<sim->evheapsize ? sim->evheap[q->heapidx+1] : NULL;
+#endif
+   return(q!=NULL || !TIMERWHEEL ? q : wheelfirst(sim, 0));
+}
+
+void printevlist(struct sim *sim)
+{
+  struct event *q;
+  printf("--------------\nEvent List Follows:\n");
+  for(q = firstevent(sim); q!=NULL; q=nextevent(sim, q)) {
+    printf("Event time: %f, type: %d entity: %d\n",TICKTIME(q->evtime),q->evtype,q->eventity);
+    }
+  printf("--------------\n");
+}
+
+
+
+/********************** Student-callable ROUTINES ***********************/
+
+/* called by students routine to cancel a previously-started timer */
+void stoptimer(struct sim *sim, int AorB) /* A or B is trying to stop timer */
+{
+ struct event *q;
+
+ TRACEREC(sim, 3, TR_STOPTIMER, AorB, 0, 0, 0, 0.0, NULL, 0);
+ /* each entity has at most one timer event, which we keep a handle to */
+ q = sim->timerev[AorB];
+ if (q==NULL) {
+    traceprintf(sim, "Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+    }
+ /* remove this event */
+ removeevent(sim, q);
+ freeevent(sim, q);
+ sim->timerev[AorB] = NULL;
+}
+
+
+void starttimer(struct sim *sim, int AorB, float increment)  /* A or B is trying to stop timer */
+{
+
+ struct event *evptr;
+//  char *malloc();
+
+ TRACEREC(sim, 3, TR_STARTTIMER, AorB, 0, 0, 0, 0.0, NULL, 0);
+ /* be nice: check to see if timer is already started, if so, then  warn */
+   if (sim->timerev[AorB]!=NULL) {
+      traceprintf(sim, "Warning: attempt to start a timer that is already started\n");
+      return;
+      }
+ 
+/* create future event for when timer goes off */
+   evptr = allocevent(sim);
+   evptr->evtime =  sim->now + TICKS(increment);
+   evptr->evtype =  TIMER_INTERRUPT;
+   evptr->eventity = AorB;
+   evptr->timerid = 0;
+   insertevent(sim, evptr);
+   sim->timerev[AorB] = evptr;
+} 
+
+/* beyond the one timer starttimer() and stoptimer() look after, an entity
+   can run any number of timers, each with an id of its choosing that its
+   timer interrupt routine gets back when the timer goes off. */
+struct timerh settimer(struct sim *sim, int AorB, float increment, int id)
+{
+ struct timerh h;
+ struct event *evptr;
+
+ TRACEREC(sim, 3, TR_STARTTIMER, AorB, id, 0, 0, 0.0, NULL, 0);
+ evptr = allocevent(sim);
+ evptr->evtime =  sim->now + TICKS(increment);
+ evptr->evtype =  TIMER_INTERRUPT;
+ evptr->eventity = AorB;
+ evptr->timerid = id;
+ insertevent(sim, evptr);
+ h.ev = evptr;
+ h.evseq = evptr->evseq;
+ return(h);
+}
+
+/* 1 if the timer is still to go off */
+int timerpending(struct timerh *h)
+{
+ return(h->ev!=NULL && h->ev->evseq==h->evseq);
+}
+
+/* a timer has gone off: it is no longer running by the time its interrupt
+   routine is called, so that routine can't stop or cancel it again */
+void timerfired(struct sim *sim, struct event *ev)
+{
+ if (sim->timerev[ev->eventity]==ev)
+    sim->timerev[ev->eventity] = NULL;
+ ev->evseq = (unsigned long)-1;   /* no timer handle matches it now */
+}
+
+/* stop a timer, returns 0 if it had already gone off or been stopped */
+int canceltimer(struct sim *sim, struct timerh *h)
+{
+ TRACEREC(sim, 3, TR_STOPTIMER, h->ev!=NULL ? h->ev->eventity : 0, 0, 0, 0, 0.0, NULL, 0);
+ if (!timerpending(h))
+    return(0);
+ removeevent(sim, h->ev);
+ freeevent(sim, h->ev);
+ h->ev = NULL;
+ return(1);
+}
+
+
+/************************** LINKS ***************/
+/* bytes in the link's queue at time t, the one being sent included */
+float linkbacklog(struct link *lk, int64_t t)
+{
+   return(lk->busyuntil > t ? TICKTIME(lk->busyuntil - t)*lk->bandwidth : 0.0);
+}
+
+/* x to the power n, n >= 0 */
+float powi(float x, long n)
+{
+   float r = 1.0;
+
+   for (; n>0; n>>=1, x*=x)
+      if (n&1)
+         r *= x;
+   return(r);
+}
+
+/* may a packet of size bytes join the queue of lk? drop-tail takes it if
+   it fits. RED (Floyd and Jacobson, "Random Early Detection Gateways for
+   Congestion Avoidance") also keeps an average of the queue length, and
+   drops every packet while that is above three quarters of the queue,
+   and a growing share of them, up to RED_MAXP, above a quarter */
+int linkadmit(struct sim *sim, struct link *lk, int size)
+{
+   float q, minth, maxth, pb, pa;
+
+   q = linkbacklog(lk, sim->now);
+   if (lk->qlimit > 0 && q + size > lk->qlimit)
+      return(0);
+   if (sim->qdisc!=QD_RED || lk->qlimit<=0)
+      return(1);
+   if (q > 0.0)
+      lk->redavg += RED_WQ*(q - lk->redavg);
+    else   /* decay as if packets of this size had been sent while idle */
+      lk->redavg *= powi(1.0-RED_WQ, (long)(TICKTIME(sim->now - lk->busyuntil)*lk->bandwidth/size));
+   minth = lk->qlimit/4.0;
+   maxth = 3*lk->qlimit/4.0;
+   if (lk->redavg < minth) {
+      lk->redcount = 0;
+      return(1);
+      }
+   if (lk->redavg >= maxth) {
+      lk->redcount = 0;
+      return(0);
+      }
+   /* the more packets since the last drop, the likelier the next one */
+   pb = RED_MAXP*(lk->redavg - minth)/(maxth - minth);
+   pa = lk->redcount*pb < 1.0 ? pb/(1.0 - lk->redcount*pb) : 1.0;
+   lk->redcount++;
+   if (jimsrand(sim, RAND_QUEUE) < pa) {
+      lk->redcount = 0;
+      return(0);
+      }
+   return(1);
+}
+
+/* queue a packet of size bytes on lk, returns when it will have been sent */
+int64_t linksend(struct sim *sim, struct link *lk, int size)
+{
+   int64_t start, send;
+
+   start = lk->busyuntil > sim->now ? lk->busyuntil : sim->now;
+   send = TICKS(size/lk->bandwidth);
+   lk->busyuntil = start + send;
+   lk->busytime += send;
+   return(lk->busyuntil);
+}
+
+/************************** SEND QUEUES ***************/
+/* the queue's length changes by dn */
+void sendqcount(struct sim *sim, struct sendq *sq, int dn)
+{
+   sq->depthtime += (double)sq->n*(sim->now - sq->lastchange);
+   sq->lastchange = sim->now;
+   sq->n += dn;
+   if (sq->n > sq->maxdepth)
+      sq->maxdepth = sq->n;
+}
+
+/* queue a message the protocol can't send yet. returns 0 if there is no
+   room, and the message is still the protocol's to drop */
+int sendqput(struct sim *sim, int AorB, struct msg message)
+{
+   struct sendq *sq = &sim->sendq[AorB];
+
+   if (sq->n >= sim->sendqlen)
+      return(0);
+   if (sq->q==NULL &&
+       (sq->q = (struct msg *)malloc(sim->sendqlen*sizeof(struct msg)))==NULL) {
+      printf("INTERNAL PANIC: out of memory for send queue\n");
+      exit(1);
+      }
+   sq->q[(sq->head+sq->n) % sim->sendqlen] = message;
+   sendqcount(sim, sq, 1);
+   return(1);
+}
+
+/* take the oldest queued message, returns 0 if there is none. that makes
+   room for the message layer 5 is waiting on, if any, and layer 5 goes on */
+int sendqget(struct sim *sim, int AorB, struct msg *message)
+{
+   struct sendq *sq = &sim->sendq[AorB];
+
+   if (sq->n==0)
+      return(0);
+   *message = sq->q[sq->head];
+   sq->head = (sq->head+1) % sim->sendqlen;
+   sendqcount(sim, sq, -1);
+   if (sq->held.data!=NULL) {
+      sendqput(sim, AorB, sq->held);
+      sq->held.data = NULL;
+      sq->blocktime += sim->now - sq->heldsince;
+      generate_next_arrival(sim, AorB);
+      }
+   return(1);
+}
+
+/* messages in the queue, averaged over the run */
+float sendqdepth(struct sim *sim, int AorB)
+{
+   struct sendq *sq = &sim->sendq[AorB];
+
+   if (sim->now==0)
+      return(0.0);
+   return((sq->depthtime + (double)sq->n*(sim->now - sq->lastchange))/sim->now);
+}
+
+/* the fraction of the run layer 5 spent waiting for room in the queue */
+float sendqblocked(struct sim *sim, int AorB)
+{
+   struct sendq *sq = &sim->sendq[AorB];
+   int64_t t = sq->blocktime;
+
+   if (sq->held.data!=NULL)
+      t += sim->now - sq->heldsince;
+   return(sim->now>0 ? (double)t/sim->now : 0.0);
+}
+
+/************************** LATENCY ***************/
+/* the highest bit set in x, x > 0 */
+int highbit(uint64_t x)
+{
+#ifdef __GNUC__
+   return(63 - __builtin_clzll(x));
+#else
+   int i;
+
+   for (i=0; x >>= 1; i++)
+      ;
+   return(i);
+#endif
+}
+
+/* remember when a message came down from layer 5 */
+void stamppush(struct stampq *q, int64_t t)
+{
+   int64_t *grown;
+   int i;
+
+   if (q->n==q->size) {       /* full: double it, unwrapping the ring */
+      grown = (int64_t *)malloc((q->size>0 ? 2*q->size : 64)*sizeof(int64_t));
+      if (grown==NULL) {
+         printf("INTERNAL PANIC: out of memory for message stamps\n");
+         exit(1);
+         }
+      for (i=0; i<q->n; i++)
+         grown[i] = q->t[(q->head+i) & (q->size-1)];
+      free(q->t);
+      q->t = grown;
+      q->head = 0;
+      q->size = q->size>0 ? 2*q->size : 64;
+      }
+   q->t[(q->head+q->n) & (q->size-1)] = t;
+   q->n++;
+}
+
+/* take the oldest stamp off q, returns 0 if there is none */
+int stamppop(struct stampq *q, int64_t *t)
+{
+   if (q->n==0)
+      return(0);
+   *t = q->t[q->head];
+   q->head = (q->head+1) & (q->size-1);
+   q->n--;
+   return(1);
+}
+
+int hdrbucket(int64_t v)
+{
+   int shift;
+
+   if (v < HDR_SUB)
+      return((int)v);
+   shift = highbit(v) - (HDR_SUBBITS-1);
+   return(shift*HDR_HALF + (int)(v >> shift));
+}
+
+/* the highest value that goes into bucket i */
+int64_t hdrvalue(int i)
+{
+   int shift;
+
+   if (i < HDR_SUB)
+      return(i);
+   shift = i/HDR_HALF - 1;
+   return(((int64_t)(i%HDR_HALF + HDR_HALF + 1) << shift) - 1);
+}
+
+void hdrrecord(struct hdrhist *h, int64_t v)
+{
+   if (v < 0)
+      v = 0;
+   h->counts[hdrbucket(v)]++;
+   if (h->n==0 || v < h->min)
+      h->min = v;
+   if (v > h->max)
+      h->max = v;
+   h->sum += v;
+   h->n++;
+}
+
+/* the value p percent of those recorded are at or below, in time units */
+double hdrpercentile(struct hdrhist *h, double p)
+{
+   long rank, seen = 0;
+   int i;
+
+   if (h->n==0)
+      return(0.0);
+   rank = (long)(p/100.0*h->n + 0.999999);
+   if (rank < 1)
+      rank = 1;
+   for (i=0; i<HDR_NBUCKETS; i++) {
+      seen += h->counts[i];
+      if (seen >= rank)
+         break;
+      }
+   return(TICKTIME(hdrvalue(i) < h->max ? hdrvalue(i) : h->max));
+}
+
+/************************** TOLAYER3 ***************/
+void tolayer3(struct sim *sim, int AorB, struct pkt *packet) /* A or B is trying to stop timer */
+{
+ struct pkt *mypktptr;
+ struct event *evptr;
+ struct link *lk = &sim->link[AorB];
+//  char *malloc();
+ int64_t lastime, sent = 0;
+ float x;
+
+
+ if (packet->len < 0 || packet->len > sim->mss) {
+    traceprintf(sim, "Warning: packet with %d bytes of payload, more than the MSS of %d. Not sent.\n",
+                packet->len, sim->mss);
+    return;
+    }
+ sim->ntolayer3++;
+ if (packet->len == 0)
+    sim->nackpkts++;
+ if (sim->replay) {  /* the log already holds what became of the packet */
+    TRACEREC(sim, 3, TR_SEND, AorB, packet->seqnum, packet->acknum,
+             packet->checksum, 0.0, packet->payload, packet->len);
+    return;
+    }
+
+ /* simulate the link's queue, packets lost on the wire still took their turn */
+ if (lk->bandwidth > 0.0) {
+    if (!linkadmit(sim, lk, LINKHDRBYTES + packet->len)) {
+       sim->nqdrop++;
+       TRACEREC(sim, 1, TR_QDROP, AorB, 0, 0, 0, 0.0, NULL, 0);
+       return;
+       }
+    sent = linksend(sim, lk, LINKHDRBYTES + packet->len);
+    }
+
+ /* simulate losses: */
+ if (jimsrand(sim, RAND_LOSS) < sim->lossprob)  {
+      sim->nlost++;
+      TRACEREC(sim, 1, TR_LOST, AorB, 0, 0, 0, 0.0, NULL, 0);
+      return;
+    }  
+
+/* hold on to the packet student just gave me. he/she may send it again */
+/* or drop it after we return back to him/her, but won't change it */
+ mypktptr = holdpkt(packet);
+ TRACEREC(sim, 3, TR_SEND, AorB, mypktptr->seqnum, mypktptr->acknum,
+          mypktptr->checksum, 0.0, mypktptr->payload, mypktptr->len);
+
+/* create future event for arrival of packet at the other side */
+  evptr = allocevent(sim);
+  evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
+  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
+  evptr->pktptr = mypktptr;       /* save ptr to my reference to packet */
+/* finally, compute the arrival time of packet at the other end.
+   medium can not reorder, so make sure packet arrives between 1 and 10
+   time units after the latest arrival time of packets
+   currently in the medium on their way to the destination.
+   packets that already arrived did so at or before the current time, so
+   remembering the last scheduled arrival per direction is enough.
+   a link sends packets in order and they all take propdelay to get
+   across, so they can't overtake each other either */
+ if (lk->bandwidth > 0.0)
+    evptr->evtime = sent + TICKS(lk->propdelay);
+  else {
+    lastime = sim->now;
+    if (sim->lastarrival[evptr->eventity] > lastime)
+       lastime = sim->lastarrival[evptr->eventity];
+    evptr->evtime =  lastime + TICKS(1 + 9*(double)jimsrand(sim, RAND_DELAY));
+    sim->lastarrival[evptr->eventity] = evptr->evtime;
+    }
+ 
+
+
+ /* simulate corruption: */
+ if (jimsrand(sim, RAND_CORRUPT) < sim->corruptprob)  {
+    sim->ncorrupt++;
+    mypktptr = evptr->pktptr = ownpkt(sim, mypktptr);  /* copy on write */
+    if ( (x = jimsrand(sim, RAND_CORRUPT)) < .75) {
+       if (mypktptr->len > 0)
+          mypktptr->payload[0]='Z';   /* corrupt payload */
+        else
+          mypktptr->checksum ^= 'Z';  /* there is none, hit the checksum */
+       }
+      else if (x < .875)
+       mypktptr->seqnum = 999999;
+      else
+       mypktptr->acknum = 999999;
+    TRACEREC(sim, 1, TR_CORRUPT, AorB, 0, 0, 0, 0.0, NULL, 0);
+    }  
+
+  TRACEREC(sim, 3, TR_SCHEDULE, AorB, 0, 0, 0, 0.0, NULL, 0);
+  insertevent(sim, evptr);
+} 
+
+void tolayer5(struct sim *sim, int AorB, char *datasent, int len)
+{
+  int64_t t;
+
+  sim->ndelivered++;
+  if (stamppop(&sim->sent[1-AorB], &t))   /* sent from the other side */
+     hdrrecord(&sim->latency, sim->now - t);
+  TRACEREC(sim, 3, TR_DELIVER, AorB, 0, 0, 0, 0.0, datasent, len);
+}
+
+/* packet checksums. the protocol hands pktchecksum() a packet and
+   compares the result with its checksum field. CK_SUM adds up seqnum,
+   acknum and the payload bytes, as the original protocols did, which misses
+   any reordering of the payload. CK_INET and CK_CRC32C cover the header
+   too, laid out as bytes: seqnum, acknum, len and msglen big endian, then
+   the payload, so they come out the same on every host. */
+#define  CKHDRBYTES  16
+
+void pkthdrbytes(unsigned char *buf, struct pkt *packet)
+{
+  int i;
+
+  for (i=0; i<4; i++) {
+     buf[i] = (unsigned int)packet->seqnum >> (24-8*i);
+     buf[4+i] = (unsigned int)packet->acknum >> (24-8*i);
+     buf[8+i] = (unsigned int)packet->len >> (24-8*i);
+     buf[12+i] = (unsigned int)packet->msglen >> (24-8*i);
+     }
+}
+
+/* ones' complement sum of the 16 bit words, added 32 bits at a time and
+   folded at the end as RFC 1071 suggests. n must be even unless buf is
+   the last piece summed */
+uint64_t inetadd(uint64_t sum, unsigned char *buf, int n)
+{
+  int i;
+
+  for (i=0; i+4<=n; i+=4)
+     sum += (uint32_t)buf[i]<<24 | (uint32_t)buf[i+1]<<16 | buf[i+2]<<8 | buf[i+3];
+  for (; i+2<=n; i+=2)
+     sum += buf[i]<<8 | buf[i+1];
+  if (i<n)
+     sum += buf[i]<<8;
+  return(sum);
+}
+
+int inetfold(uint64_t sum)
+{
+  while (sum>>16)
+     sum = (sum & 0xffff) + (sum>>16);
+  return(~sum & 0xffff);
+}
+
+/* CRC32C, reflected polynomial 0x82f63b78. crc32csw() goes a byte at a
+   time through a table, crc32chw() uses the SSE4.2 or ARMv8 crc32c
+   instructions 8 bytes at a time when the cpu has them. both take and
+   return the crc before the final inversion, so they can be chained */
+uint32_t crc32ctable[256];
+int crc32chwok;                /* crc32chw() works on this cpu */
+pthread_once_t crc32conce = PTHREAD_ONCE_INIT;
+
+void crc32cinit(void)
+{
+  uint32_t c;
+  int i, k;
+
+  for (i=0; i<256; i++) {
+     for (c = i, k = 0; k<8; k++)
+        c = c & 1 ? c>>1 ^ 0x82f63b78 : c>>1;
+     crc32ctable[i] = c;
+     }
+#if defined(__GNUC__) && defined(__x86_64__)
+  crc32chwok = __builtin_cpu_supports("sse4.2");
+#elif defined(__ARM_FEATURE_CRC32)
+  crc32chwok = 1;
+#endif
+}
+
+uint32_t crc32csw(uint32_t crc, unsigned char *buf, int n)
+{
+  while (n-- > 0)
+     crc = crc32ctable[(crc ^ *buf++) & 0xff] ^ crc>>8;
+  return(crc);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32chw(uint32_t crc, unsigned char *buf, int n)
+{
+  uint64_t crc64 = crc, w;
+
+  for (; n>=8; n-=8, buf+=8) {
+     memcpy(&w, buf, 8);
+     crc64 = _mm_crc32_u64(crc64, w);
+     }
+  crc = crc64;
+  while (n-- > 0)
+     crc = _mm_crc32_u8(crc, *buf++);
+  return(crc);
+}
+#elif defined(__ARM_FEATURE_CRC32)
+uint32_t crc32chw(uint32_t crc, unsigned char *buf, int n)
+{
+  uint64_t w;
+
+  for (; n>=8; n-=8, buf+=8) {
+     memcpy(&w, buf, 8);
+     crc = __crc32cd(crc, w);
+     }
+  while (n-- > 0)
+     crc = __crc32cb(crc, *buf++);
+  return(crc);
+}
+#else
+uint32_t crc32chw(uint32_t crc, unsigned char *buf, int n)
+{
+  return(crc32csw(crc, buf, n));
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, unsigned char *buf, int n)
+{
+  pthread_once(&crc32conce, crc32cinit);
+  if (crc32chwok)
+     return(crc32chw(crc, buf, n));
+  return(crc32csw(crc, buf, n));
+}
+
+int pktchecksum(struct sim *sim, struct pkt *packet)
+{
+  unsigned char hdr[CKHDRBYTES];
+  int i, sum;
+
+  if (sim->cksum==CK_SUM) {
+     sum = packet->seqnum + packet->acknum;
+     for (i=0; i<packet->len; i++)
+        sum += packet->payload[i];
+     return(sum);
+     }
+  pkthdrbytes(hdr, packet);
+  if (sim->cksum==CK_INET)
+     return(inetfold(inetadd(inetadd(0, hdr, CKHDRBYTES),
+                             (unsigned char *)packet->payload, packet->len)));
+  return((int)~crc32c(crc32c(0xffffffff, hdr, CKHDRBYTES),
+                      (unsigned char *)packet->payload, packet->len));
+}
+
+/* retransmission timeout estimation, Jacobson/Karels as in RFC 6298. the
+   protocol feeds rttsample() the RTTs of packets it sent only once (Karn's
+   rule: an ACK for a resent packet can't tell which copy it answers) and
+   calls rttbackoff() when its timer expires, each time with the estimator
+   of the entity that sent, &sim->rtt[A] or &sim->rtt[B]. e->rto only
+   moves when the run asked for an adaptive timeout, so a protocol can
+   always call them. */
+#define  RTO_MIN    20.0
+#define  RTO_MAX    10000.0
+
+void rttsample(struct sim *sim, struct rtoest *e, float rtt)
+{
+  float err;
+
+  if (e->minrtt==0.0 || rtt < e->minrtt)
+     e->minrtt = rtt;
+  if (e->srtt==0.0) {             /* first measurement */
+     e->srtt = rtt;
+     e->rttvar = rtt/2;
+     }
+  else {
+     err = rtt - e->srtt;
+     e->rttvar += ((err<0 ? -err : err) - e->rttvar)/4;
+     e->srtt += err/8;
+     }
+  rttrestore(sim, e);
+}
+
+/* the timeout from the estimate, without any backoff. only rttsample()
+   calls it: an ACK for a resent packet can't be timed, so under Karn's
+   rule it leaves a backed-off timeout in place until a packet sent once
+   is ACKed */
+void rttrestore(struct sim *sim, struct rtoest *e)
+{
+  if (sim->adaptive && e->srtt > 0.0) {
+     e->rto = e->srtt + 4*e->rttvar;
+     if (e->rto < RTO_MIN)
+        e->rto = RTO_MIN;
+     if (e->rto > RTO_MAX)
+        e->rto = RTO_MAX;
+     }
+}
+
+void rttbackoff(struct sim *sim, struct rtoest *e)
+{
+  if (sim->adaptive) {
+     e->rto *= 2;
+     if (e->rto > RTO_MAX)
+        e->rto = RTO_MAX;
+     }
+}
+
+/* an ACK came in for a packet last resent at time resent. if it came
+   sooner than any round trip ever measured, it must answer an earlier
+   copy, and the retransmission was spurious. returns 1 (and counts it)
+   if so */
+int rttspurious(struct sim *sim, struct rtoest *e, double resent)
+{
+  if (e->minrtt > 0.0 && sim->time - resent < e->minrtt) {
+     sim->nspurious++;
+     return(1);
+     }
+  return(0);
+}
+
+/***************************** TRACE OUTPUT *****************************/
+
+/* trace output goes to stdout, or with a trace file to that file as
+   binary records. at TRACE below 0 there's no trace output at all, not
+   even warnings (sweeps run that way). */
+void traceopen(struct sim *sim, char *tracefile)
+{
+   struct tracebuf *tb;
+
+   if (sim->trace < 0)
+      return;
+   tb = (struct tracebuf *)malloc(sizeof(struct tracebuf));
+   if (tb==NULL) {
+      printf("INTERNAL PANIC: out of memory for trace buffer\n");
+      exit(1);
+      }
+   tb->used = 0;
+   tb->binary = tracefile!=NULL;
+   tb->fp = stdout;
+   if (tb->binary && (tb->fp = fopen(tracefile, "wb"))==NULL) {
+      printf("cannot write trace to %s\n", tracefile);
+      exit(1);
+      }
+   if (tb->binary)
+      fwrite(TRACEMAGIC, 1, 8, tb->fp);
+   sim->tracebuf = tb;
+}
+
+void traceflush(struct sim *sim)
+{
+   struct tracebuf *tb = sim->tracebuf;
+
+   if (tb==NULL || tb->used==0)
+      return;
+   fwrite(tb->buf, 1, tb->used, tb->fp);
+   tb->used = 0;
+   fflush(tb->fp);
+}
+
+void traceclose(struct sim *sim)
+{
+   if (sim->tracebuf==NULL)
+      return;
+   traceflush(sim);
+   if (sim->tracebuf->fp!=stdout)
+      fclose(sim->tracebuf->fp);
+   free(sim->tracebuf);
+   sim->tracebuf = NULL;
+}
+
+void traceput(struct tracebuf *tb, char *data, size_t len)
+{
+   if (tb->used+len > TRACEBUFSIZE) {
+      fwrite(tb->buf, 1, tb->used, tb->fp);
+      tb->used = 0;
+      }
+   memcpy(tb->buf+tb->used, data, len);
+   tb->used += len;
+}
+
+/* the text of a record, returns its length */
+int traceformat(struct tracerec *rec, char *data, char *line)
+{
+   int n = 0;
+
+   switch (rec->kind) {
+     case TR_EVENT:
+       n = sprintf(line, "\nEVENT time: %f,  type: %d%s entity: %d\n", TICKTIME(rec->time),
+                   rec->a, rec->a==TIMER_INTERRUPT ? ", timerinterrupt  " :
+                   rec->a==FROM_LAYER5 ? ", fromlayer5 " : ", fromlayer3 ", rec->entity);
+       break;
+     case TR_MSG:
+       n = sprintf(line, "          MAINLOOP: data given to student: ");
+       break;
+     case TR_ARRIVAL:
+       n = sprintf(line, "          GENERATE NEXT ARRIVAL: creating new arrival\n");
+       break;
+     case TR_INSERT:
+       n = sprintf(line, "            INSERTEVENT: time is %lf\n"
+                   "            INSERTEVENT: future time will be %lf\n", TICKTIME(rec->time),
+                   TICKTIME(rec->x));
+       break;
+     case TR_STOPTIMER:
+       n = sprintf(line, "          STOP TIMER: stopping timer at %f\n", TICKTIME(rec->time));
+       break;
+     case TR_STARTTIMER:
+       n = sprintf(line, "          START TIMER: starting timer at %f\n", TICKTIME(rec->time));
+       break;
+     case TR_LOST:
+       n = sprintf(line, "          TOLAYER3: packet being lost\n");
+       break;
+     case TR_SEND:
+       n = sprintf(line, "          TOLAYER3: seq: %d, ack %d, check: %d ",
+                   rec->a, rec->b, rec->c);
+       break;
+     case TR_CORRUPT:
+       n = sprintf(line, "          TOLAYER3: packet being corrupted\n");
+       break;
+     case TR_SCHEDULE:
+       n = sprintf(line, "          TOLAYER3: scheduling arrival on other side\n");
+       break;
+     case TR_DELIVER:
+       n = sprintf(line, "          TOLAYER5: data received: ");
+       break;
+     case TR_QDROP:
+       n = sprintf(line, "          TOLAYER3: packet dropped by the link's queue\n");
+       break;
+     case TR_BLOCK:
+       n = sprintf(line, "          MAINLOOP: send queue full, layer 5 waits\n");
+       break;
+     }
+   if (rec->kind==TR_MSG || rec->kind==TR_SEND || rec->kind==TR_DELIVER) {
+      memcpy(line+n, data, rec->len);    /* the first characters, verbatim */
+      n += rec->len;
+      line[n++] = '\n';
+      }
+   return(n);
+}
+
+/* write one emulator trace record, see TRACEREC() */
+void tracerecord(struct sim *sim, int kind, int entity, int a, int b, int c,
+                 int64_t x, char *data, int len)
+{
+   struct tracebuf *tb = sim->tracebuf;
+   struct tracerec rec;
+   char line[256];
+
+   if (tb==NULL)
+      return;
+   memset(&rec, 0, sizeof(rec));
+   rec.time = sim->now;
+   rec.x = x;
+   rec.a = a;
+   rec.b = b;
+   rec.c = c;
+   rec.kind = kind;
+   rec.entity = entity;
+   rec.len = data==NULL ? 0 : len<TRACEDATAMAX ? len : TRACEDATAMAX;
+   if (tb->binary) {
+      traceput(tb, (char *)&rec, sizeof(rec));
+      if (rec.len>0)
+         traceput(tb, data, rec.len);
+      }
+   else
+      traceput(tb, line, traceformat(&rec, data, line));
+}
+
+/* printf for the protocol's own commentary (through tprintf(), which only
+   calls it at TRACE 1 and up) and for the emulator's warnings */
+void traceprintf(struct sim *sim, char *fmt, ...)
+{
+   struct tracebuf *tb = sim->tracebuf;
+   struct tracerec rec;
+   char line[TRACELINEMAX];
+   va_list ap;
+   int n;
+
+   if (tb==NULL)
+      return;
+   va_start(ap, fmt);
+   n = vsnprintf(line, sizeof(line), fmt, ap);
+   va_end(ap);
+   if (n<0)
+      return;
+   if (n>=(int)sizeof(line))
+      n = sizeof(line)-1;
+   if (tb->binary) {
+      memset(&rec, 0, sizeof(rec));
+      rec.time = sim->now;
+      rec.kind = TR_TEXT;
+      rec.len = n;
+      traceput(tb, (char *)&rec, sizeof(rec));
+      }
+   traceput(tb, line, n);
+}
+
+/* -p: print a binary trace file as the text trace it stands for */
+void tracedump(char *tracefile)
+{
+   struct tracerec rec;
+   char magic[8], data[TRACELINEMAX], line[TRACELINEMAX+256];
+   FILE *fp;
+
+   if ((fp = fopen(tracefile, "rb"))==NULL) {
+      printf("cannot open trace file %s\n", tracefile);
+      exit(1);
+      }
+   if (fread(magic, 1, 8, fp)!=8 || memcmp(magic, TRACEMAGIC, 8)!=0) {
+      printf("%s is not a trace file\n", tracefile);
+      exit(1);
+      }
+   while (fread(&rec, sizeof(rec), 1, fp)==1) {
+      if (rec.len>=TRACELINEMAX || fread(data, 1, rec.len, fp)!=rec.len) {
+         printf("%s: truncated or damaged record\n", tracefile);
+         exit(1);
+         }
+      if (rec.kind==TR_TEXT)
+         fwrite(data, 1, rec.len, stdout);
+      else
+         fwrite(line, 1, traceformat(&rec, data, line), stdout);
+      }
+   fclose(fp);
+}
+
+
+/****************************** EVENT LOG *******************************/
+/* with -e every event taken off the queue is logged: its time, type and */
+/* entity, the packet it carries and the random numbers drawn while it   */
+/* was handled. -R feeds such a log back to the protocol in place of the */
+/* event queue, so the protocol sees exactly the logged inputs whatever  */
+/* it does with them, and -d compares two logs record by record.        */
+/************************************************************************/
+#define  EVLOGMAGIC     "SIMEVL6\n"
+#define  EVLOGMAXDRAWS  65535
+
+struct evloghdr {             /* the run's parameters, host byte order */
+   char magic[8];
+   int nsimmax;
+   float lossprob, corruptprob, lambda, timeoutlen;
+   int winsize, aimd, adaptive, cksum, msgsize, msgmin, mss;
+   float bandwidth[2], propdelay[2];
+   int qlimit[2], qdisc;
+   int sendqlen, sqpolicy;
+   int duplex;
+   float ackdelay;
+   int dupthresh;
+   unsigned int seed;
+};
+
+struct evrec {                /* followed by ndraws uint32_t's, each the */
+   int64_t time;              /* stream << 24 | the 24 bits drawn, then */
+   int seqnum, acknum, checksum;   /* len bytes of payload */
+   int len, msglen;
+   int timerid;
+   unsigned char type, entity;
+   unsigned short ndraws;
+};
+
+struct evlog {
+   FILE *out, *in;            /* log being written, log being replayed */
+   struct evrec rec;          /* last event logged, written once the next */
+   int pending;               /* one comes along and its draws are known */
+   uint32_t draws[EVLOGMAXDRAWS];
+   char payload[MSSMAX];
+   uint32_t replaydraws[EVLOGMAXDRAWS];
+   char replaypayload[MSSMAX];
+   int nreplaydraws;          /* draws of the event being replayed */
+};
+
+void evlogopen(struct sim *sim, char *evlogfile, char *replayfile)
+{
+   struct evlog *el;
+   struct evloghdr hdr;
+   int i;
+
+   if (evlogfile==NULL && replayfile==NULL)
+      return;
+   el = (struct evlog *)calloc(1, sizeof(struct evlog));
+   if (el==NULL) {
+      printf("INTERNAL PANIC: out of memory for event log\n");
+      exit(1);
+      }
+   if (replayfile!=NULL) {   /* the logged run's parameters, bar TRACE */
+      if ((el->in = fopen(replayfile, "rb"))==NULL) {
+         printf("cannot open event log %s\n", replayfile);
+         exit(1);
+         }
+      if (fread(&hdr, sizeof(hdr), 1, el->in)!=1 || memcmp(hdr.magic, EVLOGMAGIC, 8)!=0) {
+         printf("%s is not an event log\n", replayfile);
+         exit(1);
+         }
+      sim->nsimmax = hdr.nsimmax;
+      sim->lossprob = hdr.lossprob;
+      sim->corruptprob = hdr.corruptprob;
+      sim->lambda = hdr.lambda;
+      sim->timeoutlen = hdr.timeoutlen;
+      sim->winsize = hdr.winsize;
+      sim->aimd = hdr.aimd;
+      sim->adaptive = hdr.adaptive;
+      sim->cksum = hdr.cksum;
+      sim->msgsize = hdr.msgsize;
+      sim->msgmin = hdr.msgmin;
+      sim->mss = hdr.mss;
+      for (i=0; i<2; i++) {
+         sim->link[i].bandwidth = hdr.bandwidth[i];
+         sim->link[i].propdelay = hdr.propdelay[i];
+         sim->link[i].qlimit = hdr.qlimit[i];
+         }
+      sim->qdisc = hdr.qdisc;
+      sim->sendqlen = hdr.sendqlen;
+      sim->sqpolicy = hdr.sqpolicy;
+      sim->duplex = hdr.duplex;
+      sim->ackdelay = hdr.ackdelay;
+      sim->dupthresh = hdr.dupthresh;
+      sim->seed = hdr.seed;
+      sim->replay = 1;
+      }
+   if (evlogfile!=NULL) {
+      if ((el->out = fopen(evlogfile, "wb"))==NULL) {
+         printf("cannot write event log to %s\n", evlogfile);
+         exit(1);
+         }
+      setvbuf(el->out, NULL, _IOFBF, 256*1024);
+      }
+   sim->evlog = el;
+}
+
+/* the header of the log being written. it is written once the protocols'
+   init routines have run, so it holds the timeout and window they chose
+   when the command line left them to the protocol */
+void evlogheader(struct sim *sim)
+{
+   struct evloghdr hdr;
+   int i;
+
+   if (sim->evlog==NULL || sim->evlog->out==NULL)
+      return;
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, EVLOGMAGIC, 8);
+   hdr.nsimmax = sim->nsimmax;
+   hdr.lossprob = sim->lossprob;
+   hdr.corruptprob = sim->corruptprob;
+   hdr.lambda = sim->lambda;
+   hdr.timeoutlen = sim->timeoutlen;
+   hdr.winsize = sim->winsize;
+   hdr.aimd = sim->aimd;
+   hdr.adaptive = sim->adaptive;
+   hdr.cksum = sim->cksum;
+   hdr.msgsize = sim->msgsize;
+   hdr.msgmin = sim->msgmin;
+   hdr.mss = sim->mss;
+   for (i=0; i<2; i++) {
+      hdr.bandwidth[i] = sim->link[i].bandwidth;
+      hdr.propdelay[i] = sim->link[i].propdelay;
+      hdr.qlimit[i] = sim->link[i].qlimit;
+      }
+   hdr.qdisc = sim->qdisc;
+   hdr.sendqlen = sim->sendqlen;
+   hdr.sqpolicy = sim->sqpolicy;
+   hdr.duplex = sim->duplex;
+   hdr.ackdelay = sim->ackdelay;
+   hdr.dupthresh = sim->dupthresh;
+   hdr.seed = sim->seed;
+   fwrite(&hdr, sizeof(hdr), 1, sim->evlog->out);
+}
+
+void evlogwrite(struct evlog *el)
+{
+   if (el->pending && el->out!=NULL) {
+      fwrite(&el->rec, sizeof(el->rec), 1, el->out);
+      fwrite(el->draws, sizeof(uint32_t), el->rec.ndraws, el->out);
+      fwrite(el->payload, 1, el->rec.len, el->out);
+      }
+   el->pending = 0;
+}
+
+void evlogclose(struct sim *sim)
+{
+   struct evlog *el = sim->evlog;
+
+   if (el==NULL)
+      return;
+   evlogwrite(el);
+   if (el->out!=NULL)
+      fclose(el->out);
+   if (el->in!=NULL)
+      fclose(el->in);
+   free(el);
+   sim->evlog = NULL;
+}
+
+/* log an event about to be handled. a replayed event keeps its logged
+   draws, since replaying draws no random numbers */
+void evlogevent(struct sim *sim, struct event *ev)
+{
+   struct evlog *el = sim->evlog;
+
+   evlogwrite(el);
+   memset(&el->rec, 0, sizeof(el->rec));
+   el->rec.time = ev->evtime;
+   el->rec.type = ev->evtype;
+   el->rec.entity = ev->eventity;
+   if (ev->evtype==TIMER_INTERRUPT)
+      el->rec.timerid = ev->timerid;
+   if (ev->evtype==FROM_LAYER3) {
+      el->rec.seqnum = ev->pktptr->seqnum;
+      el->rec.acknum = ev->pktptr->acknum;
+      el->rec.checksum = ev->pktptr->checksum;
+      el->rec.len = ev->pktptr->len;
+      el->rec.msglen = ev->pktptr->msglen;
+      memcpy(el->payload, ev->pktptr->payload, el->rec.len);
+      }
+   if (sim->replay) {
+      el->rec.ndraws = el->nreplaydraws;
+      memcpy(el->draws, el->replaydraws, el->nreplaydraws*sizeof(uint32_t));
+      }
+   el->pending = 1;
+}
+
+/* a random number drawn. the ones drawn before the first event (for the
+   first arrival) aren't logged, as there is no record to put them in. a
+   replay only draws message lengths, the same ones as the logged run, and
+   the event's draws are copied from the log already */
+void evlogdraw(struct sim *sim, int stream, uint32_t bits)
+{
+   struct evlog *el = sim->evlog;
+
+   if (el->pending && !sim->replay && el->rec.ndraws<EVLOGMAXDRAWS)
+      el->draws[el->rec.ndraws++] = (uint32_t)stream<<24 | bits;
+}
+
+/* read one event record, its draws into draws[] and its payload into
+   payload[], 0 at the end of the log. exits on a damaged log */
+int evlogread(FILE *fp, char *file, struct evrec *rec, uint32_t *draws, char *payload)
+{
+   if (fread(rec, sizeof(*rec), 1, fp)!=1)
+      return(0);
+   if (fread(draws, sizeof(uint32_t), rec->ndraws, fp)!=rec->ndraws ||
+       rec->len<0 || rec->len>MSSMAX || fread(payload, 1, rec->len, fp)!=(size_t)rec->len) {
+      printf("%s: truncated event log\n", file);
+      exit(1);
+      }
+   return(1);
+}
+
+/* the next event of the log being replayed, NULL at its end. while
+   replaying, the event queue holds nothing but the protocol's timers, and
+   a timer interrupt is the protocol's own pending timer when it has one */
+struct event *replayevent(struct sim *sim)
+{
+   struct evlog *el = sim->evlog;
+   struct evrec rec;
+   struct event *ev = NULL, *q;
+
+   if (!evlogread(el->in, "replay", &rec, el->replaydraws, el->replaypayload))
+      return(NULL);
+   el->nreplaydraws = rec.ndraws;
+   if (rec.type==TIMER_INTERRUPT) {
+      for (q = firstevent(sim); q!=NULL; q = nextevent(sim, q))
+         if (q->eventity==rec.entity && q->timerid==rec.timerid &&
+             (ev==NULL || q->evtime < ev->evtime))
+            ev = q;
+      if (ev!=NULL)
+         removeevent(sim, ev);
+      else
+         traceprintf(sim, "Warning: replayed timer interrupt %d at %d, which isn't running\n",
+                     rec.timerid, rec.entity);
+      }
+   if (ev==NULL)
+      ev = allocevent(sim);
+   ev->evtime = rec.time;
+   ev->evtype = rec.type;
+   ev->eventity = rec.entity;
+   ev->timerid = rec.timerid;
+   ev->pktptr = NULL;
+   if (rec.type==FROM_LAYER3) {
+      ev->pktptr = allocpkt(sim);
+      ev->pktptr->seqnum = rec.seqnum;
+      ev->pktptr->acknum = rec.acknum;
+      ev->pktptr->checksum = rec.checksum;
+      ev->pktptr->len = rec.len;
+      ev->pktptr->msglen = rec.msglen;
+      memcpy(ev->pktptr->payload, el->replaypayload, rec.len);
+      }
+   return(ev);
+}
+
+/* -d: compare two event logs, print where they differ. returns 0 if they
+   are the same. the logs are lined up on each event's time, type, entity
+   and seqnum, so events only one run had show up as a run missing from
+   the other log, and don't throw every later event out of step. after a
+   mismatch both logs are searched up to EVDIFFWINDOW events ahead for the
+   nearest events that line up again, the fewest skipped in all (greedily,
+   not a full LCS). if none do, the two events are taken to be the same
+   one, changed */
+#define EVDIFFMAX  10         /* differences printed in full */
+#define EVDIFFBYTES 20        /* payload bytes printed */
+#define EVDIFFWINDOW 256      /* events looked ahead to line the logs up */
+
+struct evdiffrec {
+   struct evrec rec;
+   char *payload;             /* rec.len bytes */
+   uint32_t *draws;           /* rec.ndraws of them */
+};
+
+/* one log, with the events read ahead of the comparison */
+struct evdifflog {
+   FILE *fp;
+   char *file;
+   struct evdiffrec ev[EVDIFFWINDOW];   /* ring, n of them from head */
+   int head, n;
+   long next;                 /* number of ev[head] in the log */
+};
+
+/* the first few bytes, printable or not */
+void evdiffbytes(char *p, int n)
+{
+   int i;
+
+   for (i=0; i<n && i<EVDIFFBYTES; i++)
+      printf("%c", isprint((unsigned char)p[i]) ? p[i] : '.');
+}
+
+/* the i'th event not yet compared, NULL past the end of the log */
+struct evdiffrec *evdiffpeek(struct evdifflog *lg, int i)
+{
+   static uint32_t draws[EVLOGMAXDRAWS];
+   static char payload[MSSMAX];
+   struct evdiffrec *e;
+
+   while (lg->n<=i) {
+      e = &lg->ev[(lg->head+lg->n) % EVDIFFWINDOW];
+      if (!evlogread(lg->fp, lg->file, &e->rec, draws, payload))
+         return(NULL);
+      e->payload = (char *)malloc(e->rec.len+1);
+      e->draws = (uint32_t *)malloc((e->rec.ndraws+1)*sizeof(uint32_t));
+      if (e->payload==NULL || e->draws==NULL) {
+         printf("INTERNAL PANIC: out of memory comparing event logs\n");
+         exit(1);
+         }
+      memcpy(e->payload, payload, e->rec.len);
+      memcpy(e->draws, draws, e->rec.ndraws*sizeof(uint32_t));
+      lg->n++;
+      }
+   return(&lg->ev[(lg->head+i) % EVDIFFWINDOW]);
+}
+
+void evdiffpop(struct evdifflog *lg)
+{
+   struct evdiffrec *e = &lg->ev[lg->head];
+
+   free(e->payload);
+   free(e->draws);
+   lg->head = (lg->head+1) % EVDIFFWINDOW;
+   lg->n--;
+   lg->next++;
+}
+
+/* the same event, if perhaps handled differently */
+int evdiffkey(struct evrec *r1, struct evrec *r2)
+{
+   return(r1->time==r2->time && r1->type==r2->type && r1->entity==r2->entity &&
+          r1->seqnum==r2->seqnum);
+}
+
+int evdiffsame(struct evdiffrec *e1, struct evdiffrec *e2)
+{
+   struct evrec *r1 = &e1->rec, *r2 = &e2->rec;
+
+   return(evdiffkey(r1, r2) && r1->acknum==r2->acknum &&
+          r1->checksum==r2->checksum && r1->timerid==r2->timerid &&
+          r1->ndraws==r2->ndraws && r1->len==r2->len && r1->msglen==r2->msglen &&
+          memcmp(e1->payload, e2->payload, r1->len)==0 &&
+          memcmp(e1->draws, e2->draws, r1->ndraws*sizeof(uint32_t))==0);
+}
+
+/* the fields of two events that differ */
+void evdiffprint(long n1, long n2, struct evdiffrec *e1, struct evdiffrec *e2)
+{
+   struct evrec *r1 = &e1->rec, *r2 = &e2->rec;
+   int i;
+
+   if (n1==n2)
+      printf("event %ld:", n1);
+    else
+      printf("event %ld/%ld:", n1, n2);
+   if (r1->time!=r2->time)
+      printf(" time %f/%f", TICKTIME(r1->time), TICKTIME(r2->time));
+   if (r1->type!=r2->type)
+      printf(" type %d/%d", r1->type, r2->type);
+   if (r1->entity!=r2->entity)
+      printf(" entity %d/%d", r1->entity, r2->entity);
+   if (r1->seqnum!=r2->seqnum)
+      printf(" seq %d/%d", r1->seqnum, r2->seqnum);
+   if (r1->acknum!=r2->acknum)
+      printf(" ack %d/%d", r1->acknum, r2->acknum);
+   if (r1->checksum!=r2->checksum)
+      printf(" check %d/%d", r1->checksum, r2->checksum);
+   if (r1->timerid!=r2->timerid)
+      printf(" timer %d/%d", r1->timerid, r2->timerid);
+   if (r1->len!=r2->len)
+      printf(" len %d/%d", r1->len, r2->len);
+   if (r1->msglen!=r2->msglen)
+      printf(" msglen %d/%d", r1->msglen, r2->msglen);
+   if (r1->len==r2->len && memcmp(e1->payload, e2->payload, r1->len)!=0) {
+      for (i=0; e1->payload[i]==e2->payload[i]; i++)
+         ;
+      printf(" payload from byte %d ", i);
+      evdiffbytes(e1->payload+i, r1->len-i);
+      printf("/");
+      evdiffbytes(e2->payload+i, r2->len-i);
+      }
+   if (r1->ndraws!=r2->ndraws)
+      printf(" draws %d/%d", r1->ndraws, r2->ndraws);
+    else
+      for (i=0; i<r1->ndraws; i++)
+         if (e1->draws[i]!=e2->draws[i]) {
+            printf(" draw %d %u:%06x/%u:%06x", i, e1->draws[i]>>24, e1->draws[i]&0xffffff,
+                   e2->draws[i]>>24, e2->draws[i]&0xffffff);
+            break;
+            }
+   printf("\n");
+}
+
+/* drops the next k events of lg, all of them if k<0, as ones the other log
+   doesn't have. returns how many there were */
+long evdiffskip(struct evdifflog *lg, long k, int show)
+{
+   long first = lg->next;
+
+   while (k!=0 && evdiffpeek(lg, 0)!=NULL) {
+      evdiffpop(lg);
+      k--;
+      }
+   if (show && lg->next>first+1)
+      printf("events %ld-%ld only in %s\n", first, lg->next-1, lg->file);
+    else if (show && lg->next>first)
+      printf("event %ld only in %s\n", first, lg->file);
+   return(lg->next - first);
+}
+
+int evlogdiff(char *file1, char *file2)
+{
+   struct evloghdr hdr1, hdr2;
+   struct evdifflog l1, l2;
+   struct evdiffrec *e1, *e2;
+   long n = 0, ndiff = 0, nonly1 = 0, nonly2 = 0, first = -1, best;
+   int nshown = 0, show, i, j, j0, skip1, skip2;
+
+   memset(&l1, 0, sizeof(l1));
+   memset(&l2, 0, sizeof(l2));
+   l1.file = file1;
+   l2.file = file2;
+   if ((l1.fp = fopen(file1, "rb"))==NULL || (l2.fp = fopen(file2, "rb"))==NULL) {
+      printf("cannot open event logs %s and %s\n", file1, file2);
+      exit(1);
+      }
+   if (fread(&hdr1, sizeof(hdr1), 1, l1.fp)!=1 || memcmp(hdr1.magic, EVLOGMAGIC, 8)!=0 ||
+       fread(&hdr2, sizeof(hdr2), 1, l2.fp)!=1 || memcmp(hdr2.magic, EVLOGMAGIC, 8)!=0) {
+      printf("%s or %s is not an event log\n", file1, file2);
+      exit(1);
+      }
+   if (hdr1.nsimmax!=hdr2.nsimmax || hdr1.lossprob!=hdr2.lossprob ||
+       hdr1.corruptprob!=hdr2.corruptprob || hdr1.lambda!=hdr2.lambda ||
+       hdr1.timeoutlen!=hdr2.timeoutlen || hdr1.winsize!=hdr2.winsize ||
+       hdr1.aimd!=hdr2.aimd || hdr1.adaptive!=hdr2.adaptive || hdr1.cksum!=hdr2.cksum ||
+       hdr1.msgsize!=hdr2.msgsize || hdr1.msgmin!=hdr2.msgmin || hdr1.mss!=hdr2.mss ||
+       hdr1.seed!=hdr2.seed)
+      printf("parameters: messages %d/%d loss %f/%f corrupt %f/%f avgtime %f/%f "
+             "timeout %f/%f window %d/%d aimd %d/%d adaptive %d/%d checksum %d/%d "
+             "msgsize %d/%d msgmin %d/%d mss %d/%d seed %u/%u\n",
+             hdr1.nsimmax, hdr2.nsimmax, hdr1.lossprob, hdr2.lossprob,
+             hdr1.corruptprob, hdr2.corruptprob, hdr1.lambda, hdr2.lambda,
+             hdr1.timeoutlen, hdr2.timeoutlen, hdr1.winsize, hdr2.winsize,
+             hdr1.aimd, hdr2.aimd, hdr1.adaptive, hdr2.adaptive, hdr1.cksum, hdr2.cksum,
+             hdr1.msgsize, hdr2.msgsize, hdr1.msgmin, hdr2.msgmin, hdr1.mss, hdr2.mss,
+             hdr1.seed, hdr2.seed);
+
+   while (1) {
+      e1 = evdiffpeek(&l1, 0);
+      e2 = evdiffpeek(&l2, 0);
+      if (e1==NULL && e2==NULL)
+         break;
+      if (e1!=NULL && e2!=NULL && evdiffkey(&e1->rec, &e2->rec)) {
+         if (!evdiffsame(e1, e2)) {
+            if (first<0)
+               first = l1.next;
+            if (nshown++ < EVDIFFMAX)
+               evdiffprint(l1.next, l2.next, e1, e2);
+            ndiff++;
+            }
+         evdiffpop(&l1);
+         evdiffpop(&l2);
+         n++;
+         continue;
+         }
+      if (first<0)
+         first = l1.next;
+      show = nshown++ < EVDIFFMAX;
+      if (e1==NULL || e2==NULL) {   /* the rest is only in one of them */
+         nonly1 += evdiffskip(&l1, -1, show);
+         nonly2 += evdiffskip(&l2, -1, show);
+         continue;
+         }
+      /* out of step: find the events that line up again with the fewest
+         skipped. both logs are in time order, so for each event of the
+         first only the second's events at the same time can match */
+      best = 2*EVDIFFWINDOW;
+      skip1 = skip2 = 0;
+      j0 = 0;
+      for (i=0; i<EVDIFFWINDOW && i<best && (e1 = evdiffpeek(&l1, i))!=NULL; i++) {
+         while (j0<EVDIFFWINDOW && (e2 = evdiffpeek(&l2, j0))!=NULL &&
+                e2->rec.time < e1->rec.time)
+            j0++;
+         for (j=j0; j<EVDIFFWINDOW && (e2 = evdiffpeek(&l2, j))!=NULL &&
+                    e2->rec.time==e1->rec.time; j++)
+            if (evdiffkey(&e1->rec, &e2->rec)) {
+               if (i+j < best) {
+                  best = i+j;
+                  skip1 = i;
+                  skip2 = j;
+                  }
+               break;
+               }
+         }
+      if (best < 2*EVDIFFWINDOW) {
+         nonly1 += evdiffskip(&l1, skip1, show);
+         nonly2 += evdiffskip(&l2, skip2, show);
+         continue;
+         }
+      e1 = evdiffpeek(&l1, 0);   /* nothing lines up: call it one event changed */
+      e2 = evdiffpeek(&l2, 0);
+      if (show)
+         evdiffprint(l1.next, l2.next, e1, e2);
+      ndiff++;
+      evdiffpop(&l1);
+      evdiffpop(&l2);
+      n++;
+      }
+   if (nshown > EVDIFFMAX)
+      printf("(%d more differences not shown)\n", nshown-EVDIFFMAX);
+   printf("%ld events compared, %ld differ", n, ndiff);
+   if (nonly1 > 0)
+      printf(", %ld only in %s", nonly1, file1);
+   if (nonly2 > 0)
+      printf(", %ld only in %s", nonly2, file2);
+   if (first>=0)
+      printf(", first at event %ld", first);
+   printf("\n");
+   fclose(l1.fp);
+   fclose(l2.fp);
+   return(ndiff>0 || nonly1>0 || nonly2>0);
+}